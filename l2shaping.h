@@ -7,6 +7,7 @@
 
 #include <rte_vect.h>
 #include "l2shaping_policy.h"
+#include "l2shaping_time.h"
 
 #define DO_RFC_1812_CHECKS
 
@@ -68,6 +69,51 @@ struct lcore_conf {
 	void *ipv6_lookup_struct;
 } __rte_cache_aligned;
 
+struct lcore_role_conf {
+	uint8_t role;		/**< enum lcore_role */
+	uint8_t instance;	/**< index among the lcores of the same role */
+};
+
+/*
+ * per-packet metadata, kept in the mbuf private area (DPDK 19.x has no dynfields),
+ * so the stages pass plain rte_mbuf pointers and nothing is malloc'd per packet.
+ */
+struct pkt_meta {
+	uint64_t arrival_tsc;	/**< tsc when rx took the pkt */
+	uint64_t deadline;	/**< tsc when delay/reorder releases it */
+	struct rte_mbuf *tw_next;	/**< next pkt in the same timer wheel list */
+	uint32_t flow_hash;	/**< rss hash, or a hash of the src ip */
+	uint8_t impair;		/**< enum c2s_target picked by the filter */
+	uint8_t cls;		/**< send class picked by the filter */
+};
+
+#define PKT_META_PRIV_SIZE RTE_ALIGN(sizeof(struct pkt_meta), RTE_MBUF_PRIV_ALIGN)
+
+static inline struct pkt_meta *
+pkt_meta(struct rte_mbuf *m)
+{
+	return (struct pkt_meta *)rte_mbuf_to_priv(m);
+}
+
+/*
+ * bytes a frame takes on the wire besides pkt_len: FCS, preamble+SFD (8) and
+ * inter-frame gap (12). rate and fill maths count wire bytes, so the rate
+ * holds for small frames too.
+ */
+#define WIRE_OVERHEAD	(RTE_ETHER_CRC_LEN + 20)
+
+static inline int
+wire_len(uint32_t pkt_len)
+{
+	return pkt_len + WIRE_OVERHEAD;
+}
+
+/* wire bytes the c2s tx link carries in ns */
+static inline uint64_t
+ns_to_wire_bytes(uint64_t ns)
+{
+	return ns * link_speed_mbps / 8000;
+}
 
 
 
@@ -87,6 +133,11 @@ extern uint32_t hash_entry_number;
 
 extern struct lcore_conf lcore_conf[RTE_MAX_LCORE];
 
+/* Runtime lcore to pipeline stage map. */
+extern struct lcore_role_conf lcore_role[RTE_MAX_LCORE];
+extern uint16_t nb_role_instances[LCORE_ROLE_MAX];
+extern const char *lcore_role_names[LCORE_ROLE_MAX];
+
 /* Send burst of packets on an output interface */
 static inline int
 send_burst(struct lcore_conf *qconf, uint16_t n, uint16_t port)
@@ -100,12 +151,12 @@ send_burst(struct lcore_conf *qconf, uint16_t n, uint16_t port)
 
 	ret = rte_eth_tx_burst(port, queueid, m_table, n);
 	if (unlikely(ret < n)) {
-		#if 0
+		#if 1
 		do {
 			rte_pktmbuf_free(m_table[ret]);
 		} while (++ret < n);
 		#endif
-		#if 1
+		#if 0
 		//fprintf(stderr,"send_burst send fail,enq again,enque id is %d\n",qconf->tx_queue_id[port]);
 		int enq_num;
 		enq_num=rte_ring_mp_enqueue_bulk(c2s_receive_queue, &m_table[ret],n-ret,NULL);
@@ -196,6 +247,9 @@ lpm_cb_parse_ptype(uint16_t port, uint16_t queue, struct rte_mbuf *pkts[],
 int
 lpm_main_loop(__attribute__((unused)) void *dummy);
 
+void
+make_void_packs(uint32_t packet_size);
+
 /* Return ipv4/ipv6 fwd lookup struct for LPM or EM. */
 
 void *
@@ -0,0 +1,233 @@
+#ifndef _L2SHAPING_CLASS_SCHED_H_
+#define _L2SHAPING_CLASS_SCHED_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <rte_ring.h>
+#include <rte_mbuf.h>
+#include "l2shaping.h"
+
+/*
+* send class scheduler, run by the paced sender in front of the pacing.
+* class 0 (delay and reorder output, already late) is served first,
+* the other classes share what is left by deficit round robin on wire bytes,
+* so a busy class can not starve the others. a few pkts of every class are
+* staged locally, so the head pkt size is known without peeking the ring.
+*
+* with --class-rate the classes are htb leaves under the paced link: a class
+* under its rate (green) is served before the classes that borrow over their
+* rate up to their ceil (yellow), a class over its ceil (red) waits.
+*/
+
+#define CLASS_SCHED_STAGE 32
+
+enum class_color {
+	CLASS_GREEN,
+	CLASS_YELLOW,
+	CLASS_RED,
+};
+
+/*token bucket in wire bytes*/
+struct class_tb {
+	uint64_t bytes_per_sec;		//0: no limit
+	uint64_t fill_tsc;			//tsc to fill the empty bucket
+	uint64_t last;
+	int64_t tokens;
+};
+
+struct class_sched {
+	uint16_t nb_classes;
+	uint16_t cur;			//DRR class whose turn it is
+	uint8_t in_turn;		//cur already got its quantum this turn
+	uint8_t htb;			//some class has a rate or ceil
+	struct class_tb rate[C2S_MAX_CLASSES];
+	struct class_tb ceil[C2S_MAX_CLASSES];
+	uint16_t head[C2S_MAX_CLASSES];
+	uint16_t len[C2S_MAX_CLASSES];
+	int32_t deficit[C2S_MAX_CLASSES];	//wire bytes
+	uint64_t pkts[C2S_MAX_CLASSES];
+	uint64_t bytes[C2S_MAX_CLASSES];
+	struct rte_mbuf *stage[C2S_MAX_CLASSES][CLASS_SCHED_STAGE];
+};
+
+static inline void
+class_tb_init(struct class_tb *tb, uint32_t mbps, uint64_t now)
+{
+	tb->bytes_per_sec = (uint64_t)mbps * 125000;
+	tb->fill_tsc = mbps != 0 ? C2S_CLASS_BURST * tsc_hz / tb->bytes_per_sec : 0;
+	tb->last = now;
+	tb->tokens = C2S_CLASS_BURST;
+}
+
+static inline void
+class_tb_update(struct class_tb *tb, uint64_t now)
+{
+	uint64_t cycles = now - tb->last;
+
+	if (tb->bytes_per_sec == 0)
+		return;
+	tb->last = now;
+	/*a full bucket does not need the multiplication, which could overflow*/
+	if (cycles >= tb->fill_tsc)
+		tb->tokens = C2S_CLASS_BURST;
+	else
+		tb->tokens = RTE_MIN(tb->tokens + (int64_t)(cycles * tb->bytes_per_sec / tsc_hz),
+			(int64_t)C2S_CLASS_BURST);
+}
+
+static inline void
+class_sched_init(struct class_sched *s)
+{
+	uint64_t now = time_now();
+	unsigned c;
+
+	memset(s, 0, sizeof(*s));
+	s->nb_classes = c2s_nb_classes;
+	s->cur = C2S_CLASS_DEFAULT;
+	for (c = 0; c < s->nb_classes; c++) {
+		class_tb_init(&s->rate[c], c2s_class_rate[c], now);
+		class_tb_init(&s->ceil[c], c2s_class_ceil[c], now);
+		if (c2s_class_rate[c] != 0 || c2s_class_ceil[c] != 0)
+			s->htb = 1;
+	}
+}
+
+/*
+* green: under the guaranteed rate, yellow: borrowing under the ceil,
+* red: over the ceil. a class without rate only borrows
+*/
+static inline int
+class_sched_color(struct class_sched *s, unsigned c, int len)
+{
+	if (!s->htb)
+		return CLASS_GREEN;
+	if (s->ceil[c].bytes_per_sec != 0 && s->ceil[c].tokens < len)
+		return CLASS_RED;
+	if (s->rate[c].bytes_per_sec != 0 && s->rate[c].tokens >= len)
+		return CLASS_GREEN;
+	return CLASS_YELLOW;
+}
+
+/*head pkt of class c, NULL when the class is empty*/
+static inline struct rte_mbuf *
+class_sched_peek(struct class_sched *s, unsigned c)
+{
+	if (s->head[c] == s->len[c]) {
+		s->head[c] = 0;
+		s->len[c] = rte_ring_sc_dequeue_burst(c2s_class_queue[c],
+			(void **)s->stage[c], CLASS_SCHED_STAGE, NULL);
+		if (s->len[c] == 0)
+			return NULL;
+	}
+	return s->stage[c][s->head[c]];
+}
+
+static inline struct rte_mbuf *
+class_sched_take(struct class_sched *s, unsigned c)
+{
+	struct rte_mbuf *m = s->stage[c][s->head[c]++];
+
+	s->pkts[c]++;
+	s->bytes[c] += wire_len(m->pkt_len);
+	if (s->htb) {
+		/*borrowing is charged too, but at most one bucket so the class gets green again*/
+		s->rate[c].tokens = RTE_MAX(s->rate[c].tokens - wire_len(m->pkt_len),
+			-(int64_t)C2S_CLASS_BURST);
+		s->ceil[c].tokens -= wire_len(m->pkt_len);
+	}
+	return m;
+}
+
+static inline void
+class_sched_next(struct class_sched *s)
+{
+	s->in_turn = 0;
+	if (++s->cur == s->nb_classes)
+		s->cur = C2S_CLASS_DEFAULT;
+}
+
+/*pkts waiting in all classes*/
+static inline unsigned
+class_sched_count(struct class_sched *s)
+{
+	unsigned c, count = 0;
+
+	for (c = 0; c < s->nb_classes; c++)
+		count += s->len[c] - s->head[c] + rte_ring_count(c2s_class_queue[c]);
+	return count;
+}
+
+/*
+* one DRR pass over the classes of color up to max_color, the classes
+* of a worse color are skipped and keep their credit
+*/
+static inline unsigned
+class_sched_drr(struct class_sched *s, struct rte_mbuf **pkts, unsigned nb, unsigned n, int max_color)
+{
+	struct rte_mbuf *m;
+	unsigned idle = 0, c;
+
+	while (nb < n && idle < (unsigned)s->nb_classes - 1) {
+		c = s->cur;
+		m = class_sched_peek(s, c);
+		if (m == NULL) {
+			/*an empty class keeps no credit*/
+			s->deficit[c] = 0;
+			class_sched_next(s);
+			idle++;
+			continue;
+		}
+		if (class_sched_color(s, c, wire_len(m->pkt_len)) > max_color) {
+			class_sched_next(s);
+			idle++;
+			continue;
+		}
+		idle = 0;
+		if (!s->in_turn) {
+			s->deficit[c] += c2s_class_quantum[c];
+			s->in_turn = 1;
+		}
+		if (wire_len(m->pkt_len) > s->deficit[c]) {
+			class_sched_next(s);
+			continue;
+		}
+		s->deficit[c] -= wire_len(m->pkt_len);
+		pkts[nb++] = class_sched_take(s, c);
+	}
+	return nb;
+}
+
+/*take up to n pkts in send order*/
+static inline unsigned
+class_sched_dequeue(struct class_sched *s, struct rte_mbuf **pkts, unsigned n)
+{
+	uint64_t now;
+	unsigned nb = 0, c;
+
+	while (nb < n && class_sched_peek(s, C2S_CLASS_STRICT) != NULL)
+		pkts[nb++] = class_sched_take(s, C2S_CLASS_STRICT);
+
+	if (!s->htb)
+		return class_sched_drr(s, pkts, nb, n, CLASS_GREEN);
+	now = time_now();
+	for (c = C2S_CLASS_DEFAULT; c < s->nb_classes; c++) {
+		class_tb_update(&s->rate[c], now);
+		class_tb_update(&s->ceil[c], now);
+	}
+	/*guaranteed rates first, then borrowing*/
+	nb = class_sched_drr(s, pkts, nb, n, CLASS_GREEN);
+	return class_sched_drr(s, pkts, nb, n, CLASS_YELLOW);
+}
+
+/*pkts of all send class rings, for the lcores that do not run the scheduler*/
+static inline unsigned
+c2s_class_count(void)
+{
+	unsigned c, count = 0;
+
+	for (c = 0; c < c2s_nb_classes; c++)
+		count += rte_ring_count(c2s_class_queue[c]);
+	return count;
+}
+
+#endif
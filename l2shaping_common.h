@@ -195,14 +195,13 @@ send_packetsx4(struct lcore_conf *qconf, uint16_t port, struct rte_mbuf *m[],
 		
 		n = rte_eth_tx_burst(port, qconf->tx_queue_id[port], m, num);
 		if (unlikely(n < num)) {
-			#if 0
-			fprintf(stderr,"send fail,enq again\n");
+			#if 1
 			do {
 				rte_pktmbuf_free(m[n]);
 			} while (++n < num);
 			#endif
 
-			#if 1
+			#if 0
 			//fprintf(stderr,"send_packetsx4 send fail,enq again,enque id is %d\n",qconf->tx_queue_id[port]);
 			int enq_num;
 			enq_num=rte_ring_mp_enqueue_bulk(c2s_receive_queue, &m[n],num-n,NULL);
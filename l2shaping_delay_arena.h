@@ -0,0 +1,246 @@
+#ifndef _L2SHAPING_DELAY_ARENA_H_
+#define _L2SHAPING_DELAY_ARENA_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <rte_mbuf.h>
+#include <rte_malloc.h>
+#include <rte_memcpy.h>
+#include "l2shaping.h"
+#include "l2shaping_timer_wheel.h"
+
+/*
+* compact delay line, set by --delay-arena-ms. a pkt that waits at least that
+* long is copied into a byte ring of just pkt_len plus a small header and its
+* mbuf (a full RTE_MBUF_DEFAULT_BUF_SIZE buffer) goes back to the pool at once.
+* the ring is filled in arrival order and freed from its oldest record on, a
+* record released early leaves a hole until the ones before it go too.
+* the parked pkts wait in a calendar of 2^DELAY_ARENA_BUCKET_SHIFT tsc buckets;
+* DELAY_ARENA_LEAD_BUCKETS before their deadline they are rebuilt into a fresh
+* mbuf from their own pool and put on the timer wheel, which gives the exact
+* departure. a 64 byte pkt takes 144 bytes instead of about 2.4KB.
+*/
+
+#define DELAY_ARENA_REC_ALIGN 16
+#define DELAY_ARENA_LEAD_BUCKETS 2
+
+struct arena_rec {
+	uint32_t size;				//of the record, a wrap filler has only size and freed
+	uint8_t freed;
+	uint8_t pad;
+	uint16_t port;
+	uint16_t len;
+	uint16_t pad2;
+	uint32_t rss;
+	struct arena_rec *next;		//in its calendar bucket
+	struct rte_mempool *pool;	//the mbuf is rebuilt from here
+	struct pkt_meta meta;
+	uint64_t ol_flags;
+	uint32_t packet_type;
+	uint32_t pad3;
+	uint8_t data[];
+};
+
+struct arena_bucket {
+	struct arena_rec *head;
+	struct arena_rec *tail;
+};
+
+/*arena of one delay lcore*/
+struct delay_arena {
+	uint8_t *buf;
+	uint64_t size;
+	uint64_t head;				//oldest record
+	uint64_t tail;				//next record goes here
+	uint64_t used;				//bytes from head to tail, holes and fillers too
+	struct arena_bucket *cal;
+	uint64_t mask;				//calendar buckets - 1
+	uint64_t cur;				//next bucket to release
+	uint64_t parked;			//pkts in the arena now
+	uint64_t nb_parked;
+	uint64_t nb_full;			//pkts that kept their mbuf, no room or too far out
+	uint64_t nb_nombuf;			//releases put off for want of an mbuf
+};
+
+uint32_t delay_arena_ms;			//set by --delay-arena-ms, 0: off
+uint64_t delay_arena_min_tsc;		//pkts due later than this are parked
+uint64_t delay_arena_lead_tsc;		//parked pkts come back this long before their deadline
+uint64_t delay_arena_bytes;			//of one delay lcore
+uint64_t delay_arena_buckets;
+
+/*size the arenas for the delay line, max_ns: longest delay it holds*/
+static inline void
+delay_arena_init(uint64_t line_bytes, uint64_t max_ns)
+{
+	uint64_t n = 1;
+
+	delay_arena_min_tsc = ms_to_tsc(delay_arena_ms);
+	delay_arena_lead_tsc = (uint64_t)DELAY_ARENA_LEAD_BUCKETS << DELAY_ARENA_BUCKET_SHIFT;
+	if (delay_arena_min_tsc < 2 * delay_arena_lead_tsc)
+		delay_arena_min_tsc = 2 * delay_arena_lead_tsc;
+	/*a min size pkt takes a record of 144 bytes for its 84 wire bytes, twice the line holds it*/
+	delay_arena_bytes = RTE_ALIGN_CEIL(line_bytes * 2, DELAY_ARENA_REC_ALIGN);
+	while (n < (ns_to_tsc(max_ns) >> DELAY_ARENA_BUCKET_SHIFT) + 2)
+		n <<= 1;
+	delay_arena_buckets = n;
+}
+
+/*a pkt waits long enough to be parked*/
+static inline int
+delay_arena_wants(uint64_t deadline, uint64_t now)
+{
+	return deadline > now + delay_arena_min_tsc;
+}
+
+static inline struct delay_arena *
+delay_arena_create(const char *name, int socket, uint64_t now)
+{
+	struct delay_arena *a;
+
+	a = rte_zmalloc_socket(name, sizeof(*a), RTE_CACHE_LINE_SIZE, socket);
+	if (a == NULL)
+		return NULL;
+	a->buf = rte_malloc_socket(name, delay_arena_bytes, RTE_CACHE_LINE_SIZE, socket);
+	a->cal = rte_zmalloc_socket(name, delay_arena_buckets * sizeof(struct arena_bucket),
+		RTE_CACHE_LINE_SIZE, socket);
+	if (a->buf == NULL || a->cal == NULL)
+		return NULL;
+	a->size = delay_arena_bytes;
+	a->mask = delay_arena_buckets - 1;
+	a->cur = now >> DELAY_ARENA_BUCKET_SHIFT;
+	return a;
+}
+
+static inline struct arena_rec *
+arena_alloc(struct delay_arena *a, uint32_t size)
+{
+	struct arena_rec *rec;
+	uint64_t end = a->tail + size;
+
+	if (a->used != 0 && a->tail <= a->head) {
+		/*tail has wrapped, the room is up to head*/
+		if (end > a->head)
+			return NULL;
+	} else if (end > a->size) {
+		/*no room before the end, fill it and start over at 0*/
+		if (size > a->head)
+			return NULL;
+		if (a->tail < a->size) {
+			rec = (struct arena_rec *)(a->buf + a->tail);
+			rec->size = a->size - a->tail;
+			rec->freed = 1;
+			a->used += rec->size;
+		}
+		a->tail = 0;
+		end = size;
+	}
+	rec = (struct arena_rec *)(a->buf + a->tail);
+	rec->size = size;
+	rec->freed = 0;
+	a->tail = end == a->size ? 0 : end;
+	a->used += size;
+	return rec;
+}
+
+/*free a record, the head moves over every freed one*/
+static inline void
+arena_free(struct delay_arena *a, struct arena_rec *rec)
+{
+	rec->freed = 1;
+	while (a->used != 0) {
+		rec = (struct arena_rec *)(a->buf + a->head);
+		if (!rec->freed)
+			break;
+		a->used -= rec->size;
+		a->head += rec->size;
+		if (a->head == a->size)
+			a->head = 0;
+	}
+	if (a->used == 0)
+		a->head = a->tail = 0;
+}
+
+/*copy m into the arena and free it, -1 when it has to stay an mbuf*/
+static inline int
+delay_arena_park(struct delay_arena *a, struct rte_mbuf *m)
+{
+	struct pkt_meta *meta = pkt_meta(m);
+	struct arena_rec *rec;
+	struct arena_bucket *b;
+	uint64_t bucket = meta->deadline >> DELAY_ARENA_BUCKET_SHIFT;
+
+	if (bucket < a->cur)
+		bucket = a->cur;
+	if (m->nb_segs != 1 || bucket - a->cur > a->mask) {
+		a->nb_full++;
+		return -1;
+	}
+	rec = arena_alloc(a, RTE_ALIGN_CEIL(sizeof(*rec) + m->pkt_len, DELAY_ARENA_REC_ALIGN));
+	if (rec == NULL) {
+		a->nb_full++;
+		return -1;
+	}
+	rec->next = NULL;
+	rec->pool = m->pool;
+	rec->meta = *meta;
+	rec->ol_flags = m->ol_flags;
+	rec->rss = m->hash.rss;
+	rec->packet_type = m->packet_type;
+	rec->port = m->port;
+	rec->len = m->pkt_len;
+	rte_memcpy(rec->data, rte_pktmbuf_mtod(m, void *), m->pkt_len);
+	rte_pktmbuf_free(m);
+
+	b = &a->cal[bucket & a->mask];
+	if (b->tail != NULL)
+		b->tail->next = rec;
+	else
+		b->head = rec;
+	b->tail = rec;
+	a->parked++;
+	a->nb_parked++;
+	return 0;
+}
+
+/*rebuild the pkts due within the lead time and put them on tw*/
+static inline unsigned
+delay_arena_release(struct delay_arena *a, uint64_t now, struct timer_wheel *tw)
+{
+	uint64_t last = (now + delay_arena_lead_tsc) >> DELAY_ARENA_BUCKET_SHIFT;
+	struct arena_bucket *b;
+	struct arena_rec *rec;
+	struct rte_mbuf *m;
+	unsigned nb = 0;
+
+	for (; a->cur <= last; a->cur++) {
+		if (a->parked == 0) {
+			a->cur = last + 1;
+			break;
+		}
+		b = &a->cal[a->cur & a->mask];
+		while ((rec = b->head) != NULL) {
+			m = rte_pktmbuf_alloc(rec->pool);
+			if (m == NULL) {
+				/*try again on the next poll*/
+				a->nb_nombuf++;
+				return nb;
+			}
+			rte_memcpy(rte_pktmbuf_append(m, rec->len), rec->data, rec->len);
+			m->ol_flags = rec->ol_flags;
+			m->hash.rss = rec->rss;
+			m->packet_type = rec->packet_type;
+			m->port = rec->port;
+			*pkt_meta(m) = rec->meta;
+			b->head = rec->next;
+			if (b->head == NULL)
+				b->tail = NULL;
+			arena_free(a, rec);
+			a->parked--;
+			tw_insert(tw, m);
+			nb++;
+		}
+	}
+	return nb;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _L2SHAPING_DIST_H_
+#define _L2SHAPING_DIST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "l2shaping_policy.h"
+
+/*
+* pre-scaled distribution sampler. the netem tables of dist/ (tools/maketable.c)
+* hold the inverse cdf at 4096 quantiles in units of sigma/NETEM_DIST_SCALE.
+* at load time the table is interpolated to DIST_SAMPLER_SIZE quantiles and
+* mu and sigma are baked in, so a sample is one load of a ns value indexed by
+* the top bits of a random number. without a table the sampler is uniform over
+* mu +- 4 sigma, like get_dist_rand was.
+*/
+
+#define DIST_SAMPLER_BITS 14	//16384 quantiles, 128KB, stays in L2
+#define DIST_SAMPLER_SIZE (1 << DIST_SAMPLER_BITS)
+
+struct dist_sampler {
+	int64_t ns[DIST_SAMPLER_SIZE];
+};
+
+struct dist_sampler *gap_sampler;		//GAP_MEAN, GAP_JITTER, gap dist table
+struct dist_sampler *delay_sampler;		//DELAY_MEAN, DELAY_JITTER, delay dist table
+
+static inline struct dist_sampler *
+dist_sampler_create(const struct disttable *dist, int64_t mu, int64_t sigma)
+{
+	struct dist_sampler *s;
+	double pos, frac, t, x;
+	uint32_t i, k;
+
+	s = malloc(sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr, "dist sampler malloc fail!\n");
+		exit(-1);
+	}
+	for (i = 0; i < DIST_SAMPLER_SIZE; i++) {
+		if (sigma == 0) {
+			s->ns[i] = mu;
+			continue;
+		}
+		if (dist == NULL || dist->size == 0) {
+			s->ns[i] = mu - 4 * sigma + (int64_t)i * 8 * sigma / DIST_SAMPLER_SIZE;
+			continue;
+		}
+		/*quantile i of the sampler between the table quantiles k and k+1*/
+		pos = (double)i * dist->size / DIST_SAMPLER_SIZE;
+		k = (uint32_t)pos;
+		frac = pos - k;
+		t = dist->table[k];
+		if (k + 1 < dist->size)
+			t += frac * (dist->table[k + 1] - dist->table[k]);
+		x = t * sigma / NETEM_DIST_SCALE;
+		s->ns[i] = mu + (int64_t)(x >= 0 ? x + 0.5 : x - 0.5);
+	}
+	return s;
+}
+
+/*rnd: 32 random bits, e.g. from get_crandom so the samples keep its correlation*/
+static inline int64_t
+dist_sample(const struct dist_sampler *s, uint32_t rnd)
+{
+	return s->ns[rnd >> (32 - DIST_SAMPLER_BITS)];
+}
+
+#endif
@@ -0,0 +1,525 @@
+#ifndef _L2SHAPING_FLOW_DELAY_H_
+#define _L2SHAPING_FLOW_DELAY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <rte_malloc.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_lpm.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+#include "l2shaping.h"
+#include "l2shaping_dist.h"
+#include "l2shaping_rand.h"
+#include "l2shaping_delay_arena.h"
+
+/*
+* per flow delay, set by --delay-rules. a flow (5-tuple) gets a delay profile:
+* a static 5-tuple rule, else the longest client (src) prefix rule, else the
+* default profile. every delay lcore keeps its flows in its own rte_hash (the
+* flows are spread over the delay lcores by flow hash), so no lookup is shared
+* or locked; idle flows age out. a per-flow profile draws the delay once per
+* flow, so every client has its own rtt, the others draw it per pkt.
+* --delay-order keep puts the flows in the table without rules too, for the
+* departure floor of every flow.
+*
+* rules file, '#' starts a comment, times in us:
+*	profile <id> const <delay>
+*	profile <id> uniform <mean> <jitter> [per-flow]
+*	profile <id> dist <mean> <jitter> [per-flow]	shape of the DIST_FLAG 3 delay model
+*	prefix <a.b.c.d/len> <profile>
+*	flow <src ip> <dst ip> <src port> <dst port> <tcp|udp|proto> <profile>
+*	default <profile>
+*/
+
+#define DELAY_MAX_PROFILES 256
+#define DELAY_MAX_PREFIX_RULES 65536
+#define DELAY_PREFIX_TBL8S 4096		//prefixes longer than /24 need one each
+#define DELAY_MAX_FLOW_RULES 65536
+#define FLOW_TABLE_SIZE (16 * 1024 * 1024)	//flows of all delay lcores, set by --flow-table-size
+#define FLOW_AGE_MS 30000			//a flow idle this long is forgotten
+#define FLOW_AGE_SCAN 32			//flows checked for age per poll
+
+enum delay_profile_type {
+	DELAY_PROFILE_CONST,
+	DELAY_PROFILE_UNIFORM,
+	DELAY_PROFILE_DIST,
+};
+
+struct delay_profile {
+	uint8_t defined;
+	uint8_t type;
+	uint8_t per_flow;
+	int64_t mean_ns;
+	int64_t jitter_ns;
+	struct dist_sampler *sampler;	//uniform and dist
+};
+
+struct flow_key {
+	uint32_t src_ip;		//host order
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+	uint8_t pad[3];
+};
+
+struct flow_entry {
+	uint64_t last_seen;		//tsc
+	uint64_t last_deadline;	//of the last pkt, the order floor of the next
+	int64_t delay_ns;		//per-flow profiles
+	uint16_t profile;
+	uint8_t parked;			//the last pkt went to the delay arena
+};
+
+/*flows of one delay lcore*/
+struct flow_table {
+	struct rte_hash *h;
+	struct flow_entry *e;		//by rte_hash position
+	uint32_t iter;				//aging scan position
+	uint64_t age_tsc;
+	uint64_t nb_new;
+	uint64_t nb_aged;
+	uint64_t nb_full;			//new flows the table had no room for
+	uint64_t nb_floored;		//pkts held back to keep their flow in order
+	uint64_t pkts[DELAY_MAX_PROFILES];
+};
+
+struct delay_profile delay_profiles[DELAY_MAX_PROFILES];
+uint16_t delay_default_profile;
+struct rte_lpm *delay_prefix_lpm;		//client prefix to profile
+struct rte_hash *delay_flow_rules;		//static 5-tuples, read only once loaded
+uint16_t delay_flow_rule_profile[DELAY_MAX_FLOW_RULES];	//by rte_hash position
+uint32_t flow_table_size;
+BOOL delay_rules_on;
+
+/*
+* delay line capacity: the delay lcores hold up to rate x longest delay, in
+* wire bytes and in mbufs of DELAY_LINE_PKT_LEN (the mbuf pool grows by these),
+* split evenly over the delay lcores. a pkt over the share of its lcore is
+* dropped and counted instead of taking mbufs rx needs.
+*/
+uint32_t delay_line_rate_mbps;		//set by --delay-line-rate
+uint32_t delay_line_ms;				//set by --delay-line-ms, 0: the longest delay of the profiles
+uint64_t delay_line_bytes;			//of one delay lcore
+uint64_t delay_line_pkts;
+
+static inline void
+delay_profile_set(struct delay_profile *p, int type, int64_t mean_ns, int64_t jitter_ns, int per_flow)
+{
+	p->defined = 1;
+	p->type = type;
+	p->mean_ns = mean_ns;
+	p->jitter_ns = jitter_ns;
+	p->per_flow = per_flow;
+	if (type == DELAY_PROFILE_CONST)
+		p->sampler = NULL;
+	else
+		p->sampler = dist_sampler_create(type == DELAY_PROFILE_DIST ? delay_dist : NULL,
+			mean_ns, jitter_ns / 4);	//jitter == 4 sigma
+}
+
+static inline int64_t
+delay_profile_draw(const struct delay_profile *p, uint32_t rnd)
+{
+	int64_t ns;
+
+	if (p->type == DELAY_PROFILE_CONST)
+		return p->mean_ns;
+	ns = dist_sample(p->sampler, rnd);
+	return ns > 0 ? ns : 0;
+}
+
+/*profile 0 is the built in DELAY_MEAN/DELAY_JITTER, the only one without --delay-rules*/
+static inline void
+delay_profile_default(void)
+{
+	delay_profiles[0].defined = 1;
+	delay_profiles[0].type = DELAY_JITTER != 0 ? DELAY_PROFILE_DIST : DELAY_PROFILE_CONST;
+	delay_profiles[0].mean_ns = DELAY_MEAN;
+	delay_profiles[0].jitter_ns = DELAY_JITTER;
+	delay_profiles[0].sampler = delay_sampler;
+}
+
+static inline int
+delay_rules_profile(const char *s, const char *path, uint32_t line)
+{
+	char *end;
+	unsigned long id;
+
+	errno = 0;
+	id = strtoul(s, &end, 0);
+	if (errno != 0 || end == s || id >= DELAY_MAX_PROFILES) {
+		fprintf(stderr, "delay rules %s: bad profile at line %u\n", path, line);
+		exit(-1);
+	}
+	return id;
+}
+
+static inline uint32_t
+delay_rules_ip(const char *s, const char *path, uint32_t line)
+{
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, s, &addr) != 1) {
+		fprintf(stderr, "delay rules %s: bad ip %s at line %u\n", path, s, line);
+		exit(-1);
+	}
+	return rte_be_to_cpu_32(addr.s_addr);
+}
+
+/*read the rules file, exit on a bad one like parse_dist_table*/
+static inline void
+delay_rules_load(const char *path)
+{
+	struct rte_lpm_config lpm_conf = {
+		.max_rules = DELAY_MAX_PREFIX_RULES,
+		.number_tbl8s = DELAY_PREFIX_TBL8S,
+		.flags = 0,
+	};
+	struct rte_hash_parameters hash_params = {
+		.name = "delay_flow_rules",
+		.entries = DELAY_MAX_FLOW_RULES,
+		.key_len = sizeof(struct flow_key),
+		.hash_func = rte_hash_crc,
+		.hash_func_init_val = 0,
+		.socket_id = SOCKET_ID_ANY,
+	};
+	struct flow_key key;
+	FILE *file;
+	char buf[256], *fld[8], *s, *slash;
+	uint32_t line = 0, nb_prefix = 0, nb_flow = 0;
+	unsigned long depth, port;
+	int n, i, id, type, pos;
+
+	delay_prefix_lpm = rte_lpm_create("delay_prefix", SOCKET_ID_ANY, &lpm_conf);
+	delay_flow_rules = rte_hash_create(&hash_params);
+	if (delay_prefix_lpm == NULL || delay_flow_rules == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create the delay rule tables\n");
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "delay rules %s open fail!\n", path);
+		exit(-1);
+	}
+	while (fgets(buf, sizeof(buf), file)) {
+		line++;
+		s = strchr(buf, '#');
+		if (s != NULL)
+			*s = '\0';
+		n = 0;
+		for (s = strtok(buf, " \t\r\n"); s != NULL && n < (int)RTE_DIM(fld);
+				s = strtok(NULL, " \t\r\n"))
+			fld[n++] = s;
+		if (n == 0)
+			continue;
+		if (strcmp(fld[0], "profile") == 0 && n >= 4) {
+			id = delay_rules_profile(fld[1], path, line);
+			if (strcmp(fld[2], "const") == 0 && n == 4)
+				type = DELAY_PROFILE_CONST;
+			else if (strcmp(fld[2], "uniform") == 0 && n >= 5)
+				type = DELAY_PROFILE_UNIFORM;
+			else if (strcmp(fld[2], "dist") == 0 && n >= 5)
+				type = DELAY_PROFILE_DIST;
+			else
+				goto bad;
+			if (type == DELAY_PROFILE_DIST && delay_dist == NULL) {
+				fprintf(stderr, "delay rules %s: dist profile at line %u needs a delay model (DIST_FLAG 3)\n",
+					path, line);
+				exit(-1);
+			}
+			delay_profile_set(&delay_profiles[id], type,
+				(int64_t)(strtod(fld[3], NULL) * 1000),
+				type == DELAY_PROFILE_CONST ? 0 : (int64_t)(strtod(fld[4], NULL) * 1000),
+				n == 6 && strcmp(fld[5], "per-flow") == 0);
+		} else if (strcmp(fld[0], "prefix") == 0 && n == 3) {
+			slash = strchr(fld[1], '/');
+			if (slash == NULL)
+				goto bad;
+			*slash = '\0';
+			depth = strtoul(slash + 1, NULL, 10);
+			if (depth == 0 || depth > 32)
+				goto bad;
+			id = delay_rules_profile(fld[2], path, line);
+			if (rte_lpm_add(delay_prefix_lpm, delay_rules_ip(fld[1], path, line),
+					depth, id) < 0)
+				goto bad;
+			nb_prefix++;
+		} else if (strcmp(fld[0], "flow") == 0 && n == 7) {
+			memset(&key, 0, sizeof(key));
+			key.src_ip = delay_rules_ip(fld[1], path, line);
+			key.dst_ip = delay_rules_ip(fld[2], path, line);
+			port = strtoul(fld[3], NULL, 10);
+			key.src_port = port;
+			port = strtoul(fld[4], NULL, 10);
+			key.dst_port = port;
+			if (strcmp(fld[5], "tcp") == 0)
+				key.proto = IPPROTO_TCP;
+			else if (strcmp(fld[5], "udp") == 0)
+				key.proto = IPPROTO_UDP;
+			else
+				key.proto = strtoul(fld[5], NULL, 0);
+			id = delay_rules_profile(fld[6], path, line);
+			pos = rte_hash_add_key(delay_flow_rules, &key);
+			if (pos < 0)
+				goto bad;
+			delay_flow_rule_profile[pos] = id;
+			nb_flow++;
+		} else if (strcmp(fld[0], "default") == 0 && n == 2) {
+			delay_default_profile = delay_rules_profile(fld[1], path, line);
+		} else {
+			goto bad;
+		}
+	}
+	fclose(file);
+	/*a rule may name a profile defined further down, check them once all are read*/
+	for (i = 0; i < DELAY_MAX_PROFILES; i++)
+		if (!delay_profiles[i].defined)
+			delay_profile_set(&delay_profiles[i], DELAY_PROFILE_CONST,
+				delay_profiles[0].mean_ns, 0, 0);
+	delay_rules_on = TRUE;
+	fprintf(stderr, "delay rules %s: %u prefixes, %u flows, default profile %u\n",
+		path, nb_prefix, nb_flow, delay_default_profile);
+	return;
+bad:
+	fprintf(stderr, "delay rules %s: bad rule at line %u\n", path, line);
+	exit(-1);
+}
+
+/*longest delay a profile can draw*/
+static inline int64_t
+delay_profiles_max_ns(void)
+{
+	const struct delay_profile *p;
+	int64_t max = 0, ns;
+	int i;
+
+	for (i = 0; i < DELAY_MAX_PROFILES; i++) {
+		p = &delay_profiles[i];
+		if (!p->defined)
+			continue;
+		/*the sampler tables are sorted, the last quantile is the longest*/
+		ns = p->sampler != NULL ? p->sampler->ns[DIST_SAMPLER_SIZE - 1] : p->mean_ns;
+		if (ns > max)
+			max = ns;
+	}
+	return max;
+}
+
+/*size the delay line once the profiles and the delay lcores are known, returns the mbufs it needs*/
+static inline uint64_t
+delay_line_init(unsigned nb_instances)
+{
+	uint64_t max_ns, bytes;
+
+	if (nb_instances == 0)
+		return 0;
+	max_ns = delay_line_ms != 0 ? (uint64_t)delay_line_ms * 1000000 :
+		(uint64_t)delay_profiles_max_ns();
+	bytes = (uint64_t)delay_line_rate_mbps * max_ns / 8000;
+	delay_line_bytes = bytes / nb_instances;
+	/*
+	* with the arena only the pkts due within --delay-arena-ms hold an mbuf,
+	* the line takes as many min size pkts as its bytes allow
+	*/
+	delay_line_pkts = bytes / wire_len(delay_arena_ms ? RTE_ETHER_MIN_LEN - RTE_ETHER_CRC_LEN :
+		DELAY_LINE_PKT_LEN) / nb_instances;
+	/*a pkt always fits an empty line*/
+	if (delay_line_pkts == 0)
+		delay_line_pkts = 1;
+	if (delay_line_bytes < wire_len(RTE_ETHER_MAX_JUMBO_FRAME_LEN))
+		delay_line_bytes = wire_len(RTE_ETHER_MAX_JUMBO_FRAME_LEN);
+	fprintf(stderr, "delay line: %u Mbps x %lu us, %lu bytes and %lu pkts on each of %u lcores\n",
+		delay_line_rate_mbps, max_ns / 1000, delay_line_bytes, delay_line_pkts, nb_instances);
+	if (delay_arena_ms) {
+		delay_arena_init(delay_line_bytes, max_ns);
+		fprintf(stderr, "delay arena: pkts due after %u ms, %lu bytes on each of %u lcores\n",
+			delay_arena_ms, delay_arena_bytes, nb_instances);
+		/*mbufs of the pkts due before they would be parked, or back from the arena*/
+		bytes = (uint64_t)delay_line_rate_mbps *
+			tsc_to_ns(delay_arena_min_tsc + 2 * delay_arena_lead_tsc) / 8000;
+		return RTE_MIN(delay_line_pkts * nb_instances,
+			bytes / wire_len(RTE_ETHER_MIN_LEN - RTE_ETHER_CRC_LEN) + 1);
+	}
+	return delay_line_pkts * nb_instances;
+}
+
+/*flow table of one delay lcore*/
+static inline struct flow_table *
+flow_table_create(const char *name, uint32_t entries, int socket)
+{
+	struct rte_hash_parameters hash_params = {
+		.name = name,
+		.entries = entries,
+		.key_len = sizeof(struct flow_key),
+		.hash_func = rte_hash_crc,
+		.hash_func_init_val = 0,
+		.socket_id = socket,
+	};
+	struct flow_table *ft;
+
+	ft = rte_zmalloc_socket(name, sizeof(*ft), RTE_CACHE_LINE_SIZE, socket);
+	if (ft == NULL)
+		return NULL;
+	ft->h = rte_hash_create(&hash_params);
+	ft->e = rte_zmalloc_socket(name, (size_t)entries * sizeof(struct flow_entry),
+		RTE_CACHE_LINE_SIZE, socket);
+	if (ft->h == NULL || ft->e == NULL)
+		return NULL;
+	ft->age_tsc = ms_to_tsc(FLOW_AGE_MS);
+	return ft;
+}
+
+/*5-tuple of an ipv4 pkt, ports 0 when it is not tcp/udp. -1 when not ipv4*/
+static inline int
+flow_key_get(struct rte_mbuf *m, struct flow_key *key)
+{
+	struct rte_ether_hdr *eth_hdr;
+	struct rte_vlan_hdr *vhdr;
+	struct rte_ipv4_hdr *ip_hdr;
+	struct rte_udp_hdr *l4;
+	uint32_t off = sizeof(struct rte_ether_hdr);
+
+	eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+		vhdr = rte_pktmbuf_mtod_offset(m, struct rte_vlan_hdr *, off);
+		if (vhdr->eth_proto != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+			return -1;
+		off += sizeof(struct rte_vlan_hdr);
+	} else if (eth_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+		return -1;
+	}
+	ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, off);
+	memset(key, 0, sizeof(*key));
+	key->src_ip = rte_be_to_cpu_32(ip_hdr->src_addr);
+	key->dst_ip = rte_be_to_cpu_32(ip_hdr->dst_addr);
+	key->proto = ip_hdr->next_proto_id;
+	if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) {
+		/*tcp and udp both start with the two ports*/
+		l4 = rte_pktmbuf_mtod_offset(m, struct rte_udp_hdr *,
+			off + (ip_hdr->version_ihl & 0xf) * 4);
+		key->src_port = rte_be_to_cpu_16(l4->src_port);
+		key->dst_port = rte_be_to_cpu_16(l4->dst_port);
+	}
+	return 0;
+}
+
+/*profile of a new flow: static 5-tuple rule, client prefix rule, default*/
+static inline uint16_t
+flow_profile_lookup(const struct flow_key *key)
+{
+	uint32_t next_hop;
+	int32_t pos;
+
+	if (!delay_rules_on)
+		return delay_default_profile;
+	pos = rte_hash_lookup(delay_flow_rules, key);
+	if (pos >= 0)
+		return delay_flow_rule_profile[pos];
+	if (rte_lpm_lookup(delay_prefix_lpm, key->src_ip, &next_hop) == 0)
+		return next_hop;
+	return delay_default_profile;
+}
+
+/*
+* deadlines of n pkts of known flows or new ones, one bulk hash lookup.
+* rnd: a draw per pkt, get_crandom keeps successive delays correlated.
+* with delay_keep_order no pkt leaves before the one ahead of it in its flow.
+* park: NULL without the delay arena, else whether each pkt goes there; a pkt
+* behind a parked one of its flow is parked too when it keeps order, so it
+* comes back to the timer wheel after that one.
+*/
+static inline void
+flow_delay_bulk(struct flow_table *ft, const struct flow_key *keys, struct rte_mbuf **pkts,
+	const uint32_t *rnd, unsigned n, uint64_t now, uint8_t *park)
+{
+	const void *key_ptrs[RTE_HASH_LOOKUP_BULK_MAX];
+	int32_t pos[RTE_HASH_LOOKUP_BULK_MAX];
+	const struct delay_profile *p;
+	struct flow_entry *e, tmp;
+	struct pkt_meta *meta;
+	uint16_t profile;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		key_ptrs[i] = &keys[i];
+	rte_hash_lookup_bulk(ft->h, key_ptrs, n, pos);
+	for (i = 0; i < n; i++) {
+		if (pos[i] < 0) {
+			/*an earlier pkt of the burst may have added it*/
+			pos[i] = rte_hash_lookup(ft->h, &keys[i]);
+			if (pos[i] < 0) {
+				profile = flow_profile_lookup(&keys[i]);
+				p = &delay_profiles[profile];
+				pos[i] = rte_hash_add_key(ft->h, &keys[i]);
+				if (pos[i] < 0) {
+					/*table full, the flow gets per pkt draws and no order floor*/
+					ft->nb_full++;
+					e = &tmp;
+				} else {
+					ft->nb_new++;
+					e = &ft->e[pos[i]];
+				}
+				e->profile = profile;
+				e->delay_ns = p->per_flow ? delay_profile_draw(p, rnd[i]) : 0;
+				e->last_deadline = 0;
+				e->parked = 0;
+			} else {
+				e = &ft->e[pos[i]];
+			}
+		} else {
+			e = &ft->e[pos[i]];
+		}
+		e->last_seen = now;
+		p = &delay_profiles[e->profile];
+		meta = pkt_meta(pkts[i]);
+		/*the delay counts from rx, time spent in the filter and rings is part of it*/
+		meta->deadline = meta->arrival_tsc +
+			ns_to_tsc(p->per_flow && e != &tmp ? e->delay_ns : delay_profile_draw(p, rnd[i]));
+		if (delay_keep_order && e != &tmp) {
+			if (meta->deadline < e->last_deadline) {
+				meta->deadline = e->last_deadline;
+				ft->nb_floored++;
+			}
+			e->last_deadline = meta->deadline;
+		}
+		if (park != NULL) {
+			park[i] = delay_arena_wants(meta->deadline, now) ||
+				(delay_keep_order && e->parked &&
+				meta->deadline > now + delay_arena_lead_tsc);
+			e->parked = park[i];
+		}
+		ft->pkts[e->profile]++;
+	}
+}
+
+/*forget a few flows idle for FLOW_AGE_MS, called every poll*/
+static inline void
+flow_table_age(struct flow_table *ft, uint64_t now)
+{
+	const void *key;
+	void *data;
+	int32_t pos;
+	unsigned i;
+
+	for (i = 0; i < FLOW_AGE_SCAN; i++) {
+		pos = rte_hash_iterate(ft->h, &key, &data, &ft->iter);
+		if (pos < 0) {
+			ft->iter = 0;
+			return;
+		}
+		if (now - ft->e[pos].last_seen > ft->age_tsc) {
+			rte_hash_del_key(ft->h, key);
+			ft->nb_aged++;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _L2SHAPING_GAP_CALIB_H_
+#define _L2SHAPING_GAP_CALIB_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "l2shaping.h"
+
+/*
+* closed loop gap calibration, replaces a hand tuned GAP_ERROR_CORRECTION.
+* the sender keeps a bias per pkt size bucket, the time a gap comes out longer
+* than drawn, and starts every gap that much early. after each send it measures
+* what it got and moves the bias by 1/2^GAP_CALIB_EWMA_SHIFT of the error left:
+* - timer paced sender: tsc right after rte_eth_tx_burst minus the departure
+* - void pkt trains: while the tx ring is full the flushes return at line rate,
+*   the time between two flushes minus the gaps of the train
+* a short probe phase at start teaches the timer paced sender its biases before
+* the first pkt.
+*/
+
+#define GAP_CALIB_BUCKETS 4
+#define GAP_CALIB_FP_SHIFT 8		//bias fixed point
+#define GAP_CALIB_EWMA_SHIFT 4		//gain 1/16
+#define GAP_CALIB_MAX_ERR_NS 20000	//a sample further off is a stall, not bias
+#define GAP_CALIB_PROBES 256		//per bucket
+#define GAP_CALIB_PROBE_GAP_NS 20000
+
+/*upper wire size of each bucket*/
+static const int gap_calib_limit[GAP_CALIB_BUCKETS] = {
+	128, 512, 1024, INT32_MAX,
+};
+
+struct gap_calib {
+	int64_t bias_fp[GAP_CALIB_BUCKETS];	//ns << GAP_CALIB_FP_SHIFT
+	uint64_t samples[GAP_CALIB_BUCKETS];
+	uint64_t outliers;
+};
+
+static inline void
+gap_calib_init(struct gap_calib *c, int64_t bias_ns)
+{
+	unsigned b;
+
+	memset(c, 0, sizeof(*c));
+	for (b = 0; b < GAP_CALIB_BUCKETS; b++)
+		c->bias_fp[b] = bias_ns * (1 << GAP_CALIB_FP_SHIFT);
+}
+
+static inline unsigned
+gap_calib_bucket(int wire)
+{
+	unsigned b = 0;
+
+	while (wire > gap_calib_limit[b])
+		b++;
+	return b;
+}
+
+static inline int64_t
+gap_calib_bias(const struct gap_calib *c, unsigned b)
+{
+	return c->bias_fp[b] / (1 << GAP_CALIB_FP_SHIFT);
+}
+
+/*err_ns: how much longer than drawn the gap came out with the bias in use*/
+static inline void
+gap_calib_update(struct gap_calib *c, unsigned b, int64_t err_ns)
+{
+	if (err_ns > GAP_CALIB_MAX_ERR_NS || err_ns < -GAP_CALIB_MAX_ERR_NS) {
+		c->outliers++;
+		return;
+	}
+	c->bias_fp[b] += err_ns * (1 << GAP_CALIB_FP_SHIFT) / (1 << GAP_CALIB_EWMA_SHIFT);
+	c->samples[b]++;
+}
+
+/*signed tsc difference in ns*/
+static inline int64_t
+gap_calib_diff_ns(uint64_t a, uint64_t b)
+{
+	return a >= b ? (int64_t)tsc_to_ns(a - b) : -(int64_t)tsc_to_ns(b - a);
+}
+
+/*wire bytes of pkt + void pkts for a gap of gap_ns*/
+static inline int
+gap_calib_bytes(const struct gap_calib *c, unsigned b, uint32_t gap_ns)
+{
+	int64_t ns = (int64_t)gap_ns - gap_calib_bias(c, b);
+
+	return ns > 0 ? ns_to_wire_bytes(ns) : 0;
+}
+
+static inline void
+gap_calib_print(const struct gap_calib *c, const char *name)
+{
+	unsigned b;
+
+	for (b = 0; b < GAP_CALIB_BUCKETS; b++)
+		fprintf(stderr, "%s gap bias, pkts up to %d wire bytes: %ld ns, %lu samples\n",
+			name, gap_calib_limit[b], gap_calib_bias(c, b), c->samples[b]);
+	fprintf(stderr, "%s gap bias outliers %lu\n", name, c->outliers);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _L2SHAPING_GAP_SCHED_H_
+#define _L2SHAPING_GAP_SCHED_H_
+
+#include <stdint.h>
+#include <rte_malloc.h>
+#include <rte_pause.h>
+#include "l2shaping.h"
+
+/*
+* gap schedule: the gap_gen lcore draws the pkt gaps from the distribution,
+* turns them into absolute tsc departure times and line rate bytes, and hands
+* them to the c2s sender through a lock-free single producer/single consumer ring.
+* the sender turns the gap into wire bytes itself, with its calibrated bias.
+* the sender only waits for the departure and sends.
+* departures are on the producer's time line, the sender shifts them when it
+* falls behind (idle or late) so the gaps stay exact.
+*/
+
+#define GAP_SCHED_RING_SIZE 4096	//power of 2
+#define GAP_SCHED_BURST 64
+
+struct gap_slot {
+	uint64_t departure;		//tsc
+	uint32_t gap_ns;
+};
+
+struct gap_sched_ring {
+	volatile uint32_t head __rte_cache_aligned;	//written by the producer
+	volatile uint32_t tail __rte_cache_aligned;	//written by the consumer
+	struct gap_slot slot[GAP_SCHED_RING_SIZE] __rte_cache_aligned;
+};
+
+/*NULL when no gap_gen lcore runs, the sender then draws the gaps itself*/
+struct gap_sched_ring *gap_sched_ring;
+
+static inline struct gap_sched_ring *
+gap_sched_ring_create(void)
+{
+	struct gap_sched_ring *r;
+
+	r = rte_zmalloc_socket("gap_sched_ring", sizeof(*r), RTE_CACHE_LINE_SIZE, SOCKET_ID_ANY);
+	if (r == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create gap schedule ring\n");
+	return r;
+}
+
+static inline unsigned
+gap_sched_free_count(struct gap_sched_ring *r)
+{
+	return GAP_SCHED_RING_SIZE -
+		(r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+/*producer side, n must not be more than gap_sched_free_count*/
+static inline void
+gap_sched_enqueue(struct gap_sched_ring *r, const struct gap_slot *slots, unsigned n)
+{
+	uint32_t head = r->head;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		r->slot[(head + i) & (GAP_SCHED_RING_SIZE - 1)] = slots[i];
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+/*consumer side, return -1 when empty*/
+static inline int
+gap_sched_dequeue(struct gap_sched_ring *r, struct gap_slot *s)
+{
+	uint32_t tail = r->tail;
+
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return -1;
+	*s = r->slot[tail & (GAP_SCHED_RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <rte_debug.h>
 #include <rte_ether.h>
@@ -25,14 +26,24 @@
 #include <rte_udp.h>
 #include <rte_lpm.h>
 #include <rte_lpm6.h>
+#include <rte_jhash.h>
 
 #include "l2shaping.h"
 #include <rte_ring.h>
 
 #include "l2shaping_policy.h"
 #include "l2shaping_list.h"
-#include "l2shaping_min_heap.h"
-#include "l2shaping_reorder_stream_table.h"
+#include "l2shaping_timer_wheel.h"
+#include "l2shaping_stage.h"
+#include "l2shaping_gap_sched.h"
+#include "l2shaping_class_sched.h"
+#include "l2shaping_rate_profile.h"
+#include "l2shaping_mm_trace.h"
+#include "l2shaping_rand.h"
+#include "l2shaping_dist.h"
+#include "l2shaping_gap_calib.h"
+#include "l2shaping_flow_delay.h"
+#include "l2shaping_reorder.h"
 struct ipv4_l2shaping_lpm_route {
 	uint32_t ip;
 	uint8_t  depth;
@@ -120,57 +131,28 @@ uint64_t packet_sent_to_server_without_payload;
 uint64_t packet_sent_to_client_without_payload;
 
 /* forward declarations */
-void get_void_pkts(uint32_t burst_size,uint32_t packet_size);
+struct rte_mbuf *get_void_pkts(uint32_t burst_size,uint32_t packet_size);
+int mix_void_pkts(struct rte_mbuf **send_burst,int void_len,int *filled_len);
+void void_split(int void_len,int *void_num,int *first_len,int *last_len);
+int c2s_rtc_main_loop(void);
+int gap_gen_main_loop(void);
+int c2s_mm_trace_send_main_loop(void);
 uint8_t delay_level(struct rte_mbuf *m);
 int reorder_check(struct rte_mbuf *m);
 int delay_check(struct rte_mbuf *m);
 
 int max(int a,int b);
 int min(int a,int b);
-/*if belong_to_one_burst,difference less than 700ms,return 0 ,else return -1*/
-int belong_to_one_burst(struct timeval  *last,struct timeval  *current)
-{
-    int sec=current->tv_sec-last->tv_sec;
-    int usec=current->tv_usec-last->tv_usec;
-
-    if(sec==0 && (usec/1000)<=700){
-        return 0;
-    }
-    else if(sec==1 && (usec/1000)<=-300){
-        return 0;
-    }
-    else{
-        return -1;
-    }
-}
-
-int width_compute(struct timeval *last,struct timeval  *current)
-{
-	int width;
-    int sec=current->tv_sec-last->tv_sec;
-    int usec=current->tv_usec-last->tv_usec;   
-	//fprintf(file, "compute-----last sec is  %d , usec is %d ,current sec is  %d , usec is %d ,\n", last->tv_sec,last->tv_usec,current->tv_sec,current->tv_usec);
-	//fprintf(file,"sec is %d,use is %d \n",sec,usec);        
-    width=sec*1000+usec/1000; 
-	return width;
-}
-
-static void
-due_timer_handler(int sig)
-{
-	if (sig == DUE_TIMER_SIG) {
-		//fprintf(stderr,"buffer end , now the send queue count is %d,high pri snd queue is %d\n",rte_ring_count(c2s_send_queue),rte_ring_count(c2s_send_queue_highpri));
-		send_state = TRUE;
-		timing=FALSE;
-	}
-	
-}
 
 static void
 print_stats(void)
 {
 	const char clr[] = { 27, '[', '2', 'J', '\0' };
 	const char topLeft[] = { 27, '[', '1', ';', '1', 'H','\0' };
+	struct stage *st;
+	unsigned lcore_id;
+	uint64_t polls,rx_total=0,shed_total=0,shed_highpri=0;
+	struct rte_eth_stats eth_stats;
 
 	/* Clear screen and move to top left */
 	printf("%s%s", clr, topLeft);
@@ -190,6 +172,29 @@ print_stats(void)
 	printf("packet_out to client without payload: %llu\n",packet_sent_to_client_without_payload);
 	printf("packet_out to client with payload: %llu\n",packet_sent_to_client_with_payload);
 	printf("============================\n");
+	printf("==== stages ====\n");
+	printf("%-5s %-12s %-4s %14s %14s %10s %10s %6s %8s\n","lcore","stage","inst","rx","tx","drop","refused","busy%","blocked%");
+	for(lcore_id=0;lcore_id<RTE_MAX_LCORE;lcore_id++){
+		st=lcore_stage[lcore_id];
+		if(st==NULL)
+			continue;
+		polls=st->stats.busy_polls+st->stats.idle_polls+st->stats.blocked_polls;
+		printf("%-5u %-12s %-4u %14llu %14llu %10llu %10llu %5.1f%% %7.1f%%\n",lcore_id,st->name,st->instance,
+			st->stats.rx,st->stats.tx,st->stats.drop,st->stats.refused,
+			polls?st->stats.busy_polls*100.0/polls:0.0,
+			polls?st->stats.blocked_polls*100.0/polls:0.0);
+		if(lcore_role[lcore_id].role==LCORE_ROLE_C2S_RX){
+			rx_total+=st->stats.rx;
+			shed_total+=st->stats.drop;
+			shed_highpri+=st->stats.drop_highpri;
+		}
+	}
+	/*loss in front of the pipeline: nic missed (rx queue full) + shed by the rx lcores*/
+	rte_eth_stats_get(PORT_TO_CLIENT,&eth_stats);
+	printf("c2s overload loss: nic missed %llu, shed %llu (high pri %llu), loss rate %.4f%%\n",
+		eth_stats.imissed,shed_total,shed_highpri,
+		rx_total+eth_stats.imissed?(shed_total+eth_stats.imissed)*100.0/(rx_total+eth_stats.imissed):0.0);
+	printf("============================\n");
 
 }
 
@@ -208,18 +213,13 @@ pri_check(struct rte_tcp_hdr * tcp_hdr)
 }
 
 /* init_crandom - initialize correlated random number generator
- * Use entropy source for initial seed.
+ * Use entropy source for initial seed. rho in percent.
  */
 static void
 init_crandom(struct crndstate *state, uint32_t rho)
 {
-	state=(struct crndstate *)malloc(sizeof(struct crndstate));
-	if(state==NULL){
-		fprintf(stderr,"crndstate malloc fail!\n");
-		exit(-1);
-	}
 	state->rho = (((uint64_t)rho) << 32 ) / 100;
-	state->last = (uint32_t) rand();
+	state->last = (uint32_t)(lrand() >> 32);
 }
 
 /* get_crandom - correlated random number generator
@@ -233,81 +233,324 @@ get_crandom(struct crndstate *state)//whk
 	uint32_t answer;
 
 	//value = (((uint64_t) rand() <<  0) & 0x00000000FFFFFFFFull) | (((uint64_t) rand() << 32) & 0xFFFFFFFF00000000ull);
-	value=(uint32_t) rand();
+	value=(uint32_t)(lrand() >> 32);
 	if (!state || state->rho == 0)	/* no correlation */
 		return value;
 
-	//rho = state->rho + 1;
-
+	rho = state->rho;
 	answer = (value * ((1ull<<32) - rho) + state->last * rho) >> 32;
 	state->last = answer;
 
 	return answer;
 }
 
-static int
-get_dist_rand(int mu, int sigma,//whk
-		     struct crndstate *state,
-		     const struct disttable *dist)
+/*
+* pick the delay/reorder lcore of a packet by its flow hash, packets of one flow
+* always go to the same instance so per-flow state stays on one lcore.
+* the hash is the nic rss hash set at rx, without one the src ip is hashed once here
+*/
+static inline uint16_t
+c2s_stage_instance(struct rte_mbuf *m, uint16_t nb_instances)
 {
-    //int sigma = GAP_JITTER/4;//jitter == 4 sigma
-    //int mu = GAP_MEAN;
-    int i = 0;
-    int t,x;
-
-	if (sigma == 0)
-		return mu;
-
-	uint32_t rnd = get_crandom(state);
-	/* default uniform distribution */
-	if (dist == NULL){
-		return ((rnd% (2 * 4 * sigma/*GAP_JITTER*/)) + mu - 4 * sigma);
+	struct pkt_meta *meta = pkt_meta(m);
+	struct rte_ether_hdr *eth_hdr;
+	struct rte_ipv4_hdr *ip_hdr;
+
+	if (nb_instances <= 1)
+		return 0;
+	if (meta->flow_hash == 0) {
+		eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+		if (eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN))
+			ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,
+				sizeof(struct rte_ether_hdr) + sizeof(struct rte_vlan_hdr));
+		else
+			ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,
+				sizeof(struct rte_ether_hdr));
+		meta->flow_hash = rte_jhash_1word(ip_hdr->src_addr, 0);
 	}
-		
+	return meta->flow_hash % nb_instances;
+}
+
+/* where the filter sends a client packet */
+enum c2s_target {
+	C2S_TO_SEND = 0,
+	C2S_TO_DROP,
+	C2S_TO_REORDER,
+	C2S_TO_DELAY,
+};
 
-    t = dist->table[(rnd%dist->size)];
-    x = (sigma % NETEM_DIST_SCALE) * t;
+/*rnd: a draw of the lcore's lrand stream for the drop decision*/
+static inline int
+c2s_classify(struct rte_mbuf *m,uint64_t rnd)
+{
+	if(lrand_range(rnd,100)<DROP_RATIO)
+		return C2S_TO_DROP;
+	if(REORDER_MODE_OPEN && reorder_check(m))
+		return C2S_TO_REORDER;
+	if(DELAY_MODE_OPEN && delay_check(m))
+		return C2S_TO_DELAY;
+	return C2S_TO_SEND;
+}
 
-	if (x >= 0)
-		x += NETEM_DIST_SCALE/2;
-	else
-		x -= NETEM_DIST_SCALE/2;
-    
-	int value = x / NETEM_DIST_SCALE + (sigma / NETEM_DIST_SCALE) * t + mu;
+/*
+* fill the metadata of a received burst, only from the mbuf header so
+* rx does not touch packet data
+*/
+static inline void
+pkt_meta_rx(struct rte_mbuf **pkts, unsigned nb_rx)
+{
+	struct pkt_meta *meta;
+	uint64_t tsc = time_now();
+	unsigned i;
+
+	for (i = 0; i < nb_rx; i++) {
+		meta = pkt_meta(pkts[i]);
+		meta->arrival_tsc = tsc;
+		meta->deadline = 0;
+		meta->flow_hash = (pkts[i]->ol_flags & PKT_RX_RSS_HASH) ? pkts[i]->hash.rss : 0;
+		meta->impair = C2S_TO_SEND;
+		meta->cls = C2S_CLASS_DEFAULT;
+	}
+}
+
+/* put a packet that needs drop, reorder or delay on its process ring */
+static inline int
+c2s_impair_enqueue(struct rte_mbuf *m, int target)
+{
+	switch (target) {
+	case C2S_TO_DROP:
+		return rte_ring_enqueue(c2s_drop_process_queue, m);
+	case C2S_TO_REORDER:
+		return rte_ring_enqueue(c2s_reorder_process_queue[
+			c2s_stage_instance(m, nb_role_instances[LCORE_ROLE_REORDER])], m);
+	case C2S_TO_DELAY:
+		return rte_ring_enqueue(c2s_delay_process_queue[
+			c2s_stage_instance(m, nb_role_instances[LCORE_ROLE_DELAY])], m);
+	default:
+		return -1;
+	}
+}
+
+/* high priority class: tcp payload marked like pri_check does */
+static inline int
+c2s_is_highpri(struct rte_mbuf *m)
+{
+	struct rte_ether_hdr *eth_hdr;
+	struct rte_ipv4_hdr *ip_hdr;
+	struct rte_tcp_hdr *tcp_hdr;
+	uint32_t off;
+
+	eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+	off = sizeof(struct rte_ether_hdr);
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN))
+		off += sizeof(struct rte_vlan_hdr);
+	ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, off);
+	if (ip_hdr->next_proto_id != IPPROTO_TCP)
+		return 0;
+	off += (ip_hdr->version_ihl & 0xf) * 4;
+	tcp_hdr = rte_pktmbuf_mtod_offset(m, struct rte_tcp_hdr *, off);
+	off += (tcp_hdr->data_off >> 4) * 4 + 5;
+	if (off >= m->data_len)
+		return 0;
+	return *rte_pktmbuf_mtod_offset(m, uint8_t *, off) == 1;
+}
+
+/* class of the longest --class-prefix holding the server address */
+static inline uint8_t
+c2s_dst_class(uint32_t dst)
+{
+	unsigned i;
+
+	for (i = 0; i < c2s_nb_class_prefix; i++)
+		if ((dst & c2s_class_prefix[i].mask) == c2s_class_prefix[i].addr)
+			return c2s_class_prefix[i].cls;
+	return C2S_CLASS_DEFAULT;
+}
+
+/* send class of a client packet, from the field --class-by names */
+static inline uint8_t
+c2s_pkt_class(struct rte_mbuf *m)
+{
+	struct rte_ether_hdr *eth_hdr;
+	struct rte_vlan_hdr *vlan_hdr;
+	struct rte_ipv4_hdr *ip_hdr;
+	uint16_t ether_type;
+	uint32_t off = sizeof(struct rte_ether_hdr);
+
+	if (c2s_nb_classes <= C2S_CLASS_DEFAULT + 1)
+		return C2S_CLASS_DEFAULT;
+	if (c2s_class_by == CLASS_BY_MARKER)
+		return c2s_class_map[c2s_is_highpri(m)];
+
+	eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+	ether_type = eth_hdr->ether_type;
+	vlan_hdr = NULL;
+	if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+		vlan_hdr = rte_pktmbuf_mtod_offset(m, struct rte_vlan_hdr *, off);
+		ether_type = vlan_hdr->eth_proto;
+		off += sizeof(struct rte_vlan_hdr);
+	}
+	if (c2s_class_by == CLASS_BY_PCP)
+		return c2s_class_map[vlan_hdr != NULL ?
+			rte_be_to_cpu_16(vlan_hdr->vlan_tci) >> 13 : 0];
+	if (c2s_class_by == CLASS_BY_VLAN)
+		return c2s_class_map[vlan_hdr != NULL ?
+			rte_be_to_cpu_16(vlan_hdr->vlan_tci) & 0xfff : 0];
+	if (ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+		return c2s_class_by == CLASS_BY_DST ? C2S_CLASS_DEFAULT : c2s_class_map[0];
+	ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, off);
+	if (c2s_class_by == CLASS_BY_DST)
+		return c2s_dst_class(rte_be_to_cpu_32(ip_hdr->dst_addr));
+	return c2s_class_map[ip_hdr->type_of_service >> 2];
+}
+
+/*
+* put a received burst on the rx ring, what does not fit is shed by
+* overload_policy and counted as drop of the rx stage
+*/
+static inline unsigned
+rx_admit(struct stage *st, struct rte_ring *r, struct rte_mbuf **pkts, unsigned nb_rx)
+{
+	struct rte_mbuf *low[MAX_PKT_BURST];
+	unsigned i, n, nb_high;
+
+	st->stats.rx += nb_rx;
+	st->stats.busy_polls++;
+	if (overload_policy == OVERLOAD_KEEP_HIGHPRI &&
+			unlikely(rte_ring_free_count(r) < nb_rx)) {
+		/*high priority pkts first so the tail that is cut is low priority*/
+		for (i = 0, nb_high = 0, n = 0; i < nb_rx; i++) {
+			if (c2s_is_highpri(pkts[i]))
+				pkts[nb_high++] = pkts[i];
+			else
+				low[n++] = pkts[i];
+		}
+		for (i = 0; i < n; i++)
+			pkts[nb_high + i] = low[i];
+	}
+	n = rte_ring_enqueue_burst(r, (void **)pkts, nb_rx, NULL);
+	st->stats.tx += n;
+	for (i = n; i < nb_rx; i++) {
+		st->stats.drop++;
+		if (overload_policy == OVERLOAD_KEEP_HIGHPRI && c2s_is_highpri(pkts[i]))
+			st->stats.drop_highpri++;
+		rte_pktmbuf_free(pkts[i]);
+	}
+	return n;
+}
+
+/*
+* one output per send class, the output index is the class,
+* with_strict=0 leaves class 0 out for the stages that never feed it
+*/
+static inline void
+c2s_add_class_outputs(struct stage *st, int with_strict)
+{
+	int i;
+
+	for (i = 0; i < C2S_MAX_CLASSES; i++)
+		stage_add_output(st, i < c2s_nb_classes &&
+			(with_strict || i != C2S_CLASS_STRICT) ? c2s_class_queue[i] : NULL);
+}
+
+/* output layout of a stage that classifies client packets */
+#define C2S_OUT_SEND 0	//+ send class
+#define C2S_OUT_DROP C2S_MAX_CLASSES
+#define C2S_OUT_DELAY (C2S_OUT_DROP + 1)
+#define C2S_OUT_REORDER (C2S_OUT_DELAY + MAX_STAGE_INSTANCES)
+
+/*
+* the impairment rings shed, a busy delay or reorder instance drops its own
+* pkts instead of holding back the pkts of the others and the send classes
+*/
+static inline void
+c2s_add_outputs(struct stage *st)
+{
+	int i;
+
+	c2s_add_class_outputs(st, 0);
+	stage_add_shed_output(st, c2s_drop_process_queue);
+	for (i = 0; i < MAX_STAGE_INSTANCES; i++)
+		stage_add_shed_output(st, c2s_delay_process_queue[i]);
+	for (i = 0; i < MAX_STAGE_INSTANCES; i++)
+		stage_add_shed_output(st, c2s_reorder_process_queue[i]);
+}
 
-	return value;
+static inline int
+c2s_target_output(struct rte_mbuf *m, int target)
+{
+	switch (target) {
+	case C2S_TO_DROP:
+		return C2S_OUT_DROP;
+	case C2S_TO_REORDER:
+		return C2S_OUT_REORDER +
+			c2s_stage_instance(m, nb_role_instances[LCORE_ROLE_REORDER]);
+	case C2S_TO_DELAY:
+		return C2S_OUT_DELAY +
+			c2s_stage_instance(m, nb_role_instances[LCORE_ROLE_DELAY]);
+	default:
+		return C2S_OUT_SEND + pkt_meta(m)->cls;
+	}
 }
 
 /* main processing loop */
 int lpm_main_loop(__attribute__((unused)) void *dummy)
 {
 	send_state=FALSE;
-	if(IS_POLICY_LCORE)
+	lrand_init(&lrand_state[rte_lcore_id()],lrand_seed,
+		lcore_role[rte_lcore_id()].role,lcore_role[rte_lcore_id()].instance);
+	switch (lcore_role[rte_lcore_id()].role) {
+	case LCORE_ROLE_POLICY:
 		c2s_policy_main_loop();
-    if(IS_RECEIVE_LCORE_FOR_CLIENT)
-        c2s_receive_main_loop();
-	if (IS_SEND_LCORE_TO_SERVER)
-        c2s_rate_control_send_main_loop_compare();
-		//c2s_rate_control_send_main_loop();
-		
-    if (IS_RECEIVE_LCORE_FOR_SERVER)
-        s2c_receive_main_loop();
-	if (IS_SEND_LCORE_TO_CLIENT)
-        s2c_send_main_loop();
-
-	if (IS_TRANS_TO_SERVER)
+		break;
+	case LCORE_ROLE_C2S_RX:
+		c2s_receive_main_loop();
+		break;
+	case LCORE_ROLE_C2S_TX:
+		if(mm_trace!=NULL)
+			c2s_mm_trace_send_main_loop();
+		else if(c2s_sender==C2S_SENDER_TIMER)
+			c2s_rate_control_send_main_loop_compare();
+		else
+			c2s_rate_control_send_main_loop();
+		break;
+	case LCORE_ROLE_S2C_RX:
+		s2c_receive_main_loop();
+		break;
+	case LCORE_ROLE_S2C_TX:
+		s2c_send_main_loop();
+		break;
+	case LCORE_ROLE_C2S_FILTER:
 		c2s_filter_main_loop();
-	if (IS_TRANS_TO_CLIENT)
+		break;
+	case LCORE_ROLE_S2C_FILTER:
 		s2c_filter_main_loop();
-	if (IS_PRINT_LCORE)
+		break;
+	case LCORE_ROLE_PRINT:
 		print_main_loop();
-	if (IS_DROP_LCORE)
+		break;
+	case LCORE_ROLE_DROP:
 		c2s_drop_main_loop();
-	if(IS_DELAY_LCORE)
+		break;
+	case LCORE_ROLE_DELAY:
 		c2s_delay_main_loop();
-	if(IS_REORDER_LCORE)
+		break;
+	case LCORE_ROLE_REORDER:
 		c2s_reorder_main_loop();
-    return 0;
+		break;
+	case LCORE_ROLE_DUMP:
+		c2s_dump_main_loop();
+		break;
+	case LCORE_ROLE_C2S_RTC:
+		c2s_rtc_main_loop();
+		break;
+	case LCORE_ROLE_GAP_GEN:
+		gap_gen_main_loop();
+		break;
+	default:
+		break;
+	}
+	return 0;
 }
 
 #define MAX_TIMER_PERIOD 86400 
@@ -318,14 +561,14 @@ int lpm_main_loop(__attribute__((unused)) void *dummy)
 int print_main_loop(){
 	unsigned lcore_id;
 	uint64_t prev_tsc, diff_tsc, cur_tsc, timer_tsc;
-	uint64_t timer_period = 1 * rte_get_timer_hz();//1 second
-	const uint64_t drain_tsc = ((rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S) * BURST_TX_DRAIN_US;
+	uint64_t timer_period = ms_to_tsc(1000);//1 second
+	const uint64_t drain_tsc = us_to_tsc(BURST_TX_DRAIN_US);
 	prev_tsc = 0;
 	timer_tsc = 0;
 	fprintf(stderr,"lcore %d——printer\n",lcore_id);
 	sleep(3);
 	while (!force_quit) {
-		cur_tsc = rte_rdtsc();
+		cur_tsc = time_now();
 		diff_tsc = cur_tsc - prev_tsc;
 		if (unlikely(diff_tsc > drain_tsc)) {
 			/* if timer is enabled */
@@ -354,16 +597,24 @@ int c2s_receive_main_loop(){
 	uint16_t portid;
 	uint8_t queueid;
 	struct lcore_conf *qconf;
-	int test;
+	struct rte_ring *receive_queue;
+	struct stage st;
 
 	lcore_id = rte_lcore_id();
-	packet_received_from_client=0;
+	stage_init(&st,"c2s_rx");
+	/*one SP ring per rx shard keeps each rx queue in order up to its filter*/
+	if(rx_shared_ring)
+		receive_queue=c2s_receive_queue;
+	else
+		receive_queue=c2s_receive_shard_queue[st.instance];
+	stage_add_output(&st,receive_queue);
 
 	qconf = &lcore_conf[lcore_id];
 	fprintf(stderr,"lcore %d——c2s_receiver\n",lcore_id);
 
 	if (qconf->n_rx_queue == 0) {
 		RTE_LOG(INFO, l2shaping, "lcore %u has nothing to do\n", lcore_id);
+		lcore_stage[lcore_id]=NULL;
 		return 0;
 	}
 
@@ -382,7 +633,7 @@ int c2s_receive_main_loop(){
 		for (i = 0; i < qconf->n_rx_queue; ++i) {
 			portid = qconf->rx_queue_list[i].port_id;
 			queueid = qconf->rx_queue_list[i].queue_id;
-			nb_rx = rte_eth_rx_burst(PORT_TO_CLIENT, queueid, pkts_burst,
+			nb_rx = rte_eth_rx_burst(portid, queueid, pkts_burst,
 				MAX_PKT_BURST);		
 			if (nb_rx == 0)
 				continue;
@@ -414,144 +665,98 @@ int c2s_receive_main_loop(){
 		#endif
 
             /*put packet in ring*/
-            enq_num=rte_ring_sp_enqueue_bulk(c2s_receive_queue, pkts_burst,nb_rx,NULL);
-			if(enq_num==0)	
-				fprintf(stderr,"!!!!!!!!![%s] enq c2s_receive_queue fail,enq_num is %d,nb_rx is %d,[%d]!!!!!!!\n",__func__, enq_num,nb_rx, __LINE__);
-			packet_received_from_client+=enq_num;
+            pkt_meta_rx(pkts_burst,nb_rx);
+            enq_num=rx_admit(&st,receive_queue,pkts_burst,nb_rx);
+			__atomic_fetch_add(&packet_received_from_client,enq_num,__ATOMIC_RELAXED);
 		}
 	}
-	fprintf(stderr,"lcore %d——c2s_receiver:packet_received_from_client num is %llu\n",lcore_id,packet_received_from_client);
+	fprintf(stderr,"lcore %d——c2s_receiver:packet_received_from_client num is %llu,overload drop %llu (high pri %llu)\n",
+		lcore_id,packet_received_from_client,st.stats.drop,st.stats.drop_highpri);
+	lcore_stage[lcore_id]=NULL;
 	return 0;
 }
 
 /* C2S filter */
 int c2s_filter_main_loop()
 {
-    struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-	int nb_trans,i,i2,n,enq_num,deq_num,available=0;
-	int status;
-	int filter_to_sendqueue_num=0,filter_to_dumpqueue_num=0,filter_to_dropqueue_num=0,filter_to_reorderqueue_num=0,filter_to_delayqueue_num=0,filter_to_reframequeue_num=0;
-	unsigned lcore_id;
-    int count,tmpn;
-	struct rte_ipv4_hdr *ip_hdr;
-    struct rte_ether_hdr *eth_hdr;
-	struct rte_tcp_hdr *tcp_hdr;
-	struct rte_vlan_hdr *vhdr;
-	uint16_t ether_type;
-	char * payload;
-	packet_sent_to_server_without_payload=0;
-	packet_sent_to_server_high_pri=0;
-	packet_sent_to_server_low_pri=0;
-	packet_sent_to_server_with_payload_from_client=0;
+    struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE];
+	uint64_t rnd[STAGE_BURST_SIZE];
+	int i,n,tmpn,target,deq_num;
+	unsigned lcore_id,nb_small;
+	uint16_t small_queue;
+	struct stage st;
 
 	lcore_id = rte_lcore_id();
-	fprintf(stderr,"lcore %d——c2s_filter\n",lcore_id);
-    count = 0;
-	srand((unsigned)time(NULL));
+	stage_init(&st,"c2s_filter");
+	/*tx queues are not thread safe, every filter sends its small pkts on its own queue*/
+	small_queue=QUEUE_TO_SERVER_WITHOUT_PAYLOAD+st.instance;
+	/*
+	* filter j serves rx shards j, j+n_filter, ... so every shard has one consumer
+	* and its order is kept, with --rx-shared-ring all filters share one MC ring
+	*/
+	if(rx_shared_ring||nb_role_instances[LCORE_ROLE_C2S_RX]==0)
+		stage_add_input(&st,c2s_receive_queue);
+	else
+		for(i=st.instance;i<nb_role_instances[LCORE_ROLE_C2S_RX];i+=nb_role_instances[LCORE_ROLE_C2S_FILTER])
+			stage_add_input(&st,c2s_receive_shard_queue[i]);
+	c2s_add_outputs(&st);
+	fprintf(stderr,"lcore %d——c2s_filter,%d receive rings\n",lcore_id,st.nb_in);
+	if(st.nb_in==0){
+		lcore_stage[lcore_id]=NULL;
+		return 0;
+	}
     while (!force_quit) {
-		if(likely(count !=0)) {
-			nb_trans=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_trans;
-			deq_num=rte_ring_sc_dequeue_bulk(c2s_receive_queue,pkts_burst,nb_trans,&available);
-			if(deq_num==0) {
-				deq_num=rte_ring_sc_dequeue_bulk(c2s_receive_queue,pkts_burst,available,NULL);
-			}
-			if(deq_num==0) continue;
-
-			for(i=0;i<deq_num;i++){
-				/*filter loop*/
-				if(rand()%100<DROP_RATIO){
-					enq_num=rte_ring_mp_enqueue(c2s_drop_process_queue,pkts_burst[i]);
-					if(unlikely(enq_num!=0))	{
-						rte_exit(EXIT_FAILURE, "c2s_filter_main_loop lcore enq c2s_drop_process_queue fail,enq_num is %d,nb_rx is %d\n",enq_num,nb_trans);
-					}
-					filter_to_dropqueue_num+=1;
-					continue;
-				}
-				if(REORDER_MODE_OPEN){
-					status=reorder_check(pkts_burst[i]);
-					if(status){
-						enq_num=rte_ring_mp_enqueue(c2s_reorder_process_queue,pkts_burst[i]);
-						if(unlikely(enq_num!=0))	{
-							rte_exit(EXIT_FAILURE, "c2s_filter_main_loop lcore enq c2s_reorder_queue fail,enq_num is %d,nb_rx is %d\n",enq_num,nb_trans);
-						}
-						filter_to_reorderqueue_num+=1;
-						continue;
-					}
-				}
-				if(DELAY_MODE_OPEN){
-					status=delay_check(pkts_burst[i]);
-					if(status){
-						enq_num=rte_ring_mp_enqueue(c2s_delay_process_queue,pkts_burst[i]);
-						if(unlikely(enq_num!=0))	{
-							rte_exit(EXIT_FAILURE, "c2s_filter_main_loop lcore enq c2s_delay_queue fail,enq_num is %d,nb_rx is %d\n",enq_num,nb_trans);
-						}
-						filter_to_delayqueue_num+=1;
-						continue;
-					}
-					
-				}
-				if(pkts_burst[i]->pkt_len>=BUFFER_PKT_SIZE){
-
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue,pkts_burst[i]);
-					if(unlikely(enq_num!=0))	{
-						fprintf(stderr,"%s %d enq fail,we want 1 ,actually %d,ring count is %d\n",__func__,__LINE__,enq_num,rte_ring_count(c2s_send_queue));
-						exit(-1);
-					}
-					filter_to_sendqueue_num+=1;
-					
-				}
-				else{
-					n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_SERVER_WITHOUT_PAYLOAD, pkts_burst[i], 1);
-					while(n<1){ 
-						tmpn= rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_SERVER_WITHOUT_PAYLOAD, pkts_burst[i], 1);
-						n+=tmpn;
-					}
-					packet_sent_to_server_without_payload+=n;
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		lrand_fill(&lrand_state[lcore_id],rnd,deq_num);
+		nb_small=0;
+		for(i=0;i<deq_num;i++){
+			/*filter loop*/
+			target=c2s_classify(pkts_burst[i],rnd[i]);
+			pkt_meta(pkts_burst[i])->impair=target;
+			pkt_meta(pkts_burst[i])->cls=c2s_pkt_class(pkts_burst[i]);
+			if(target==C2S_TO_SEND&&pkts_burst[i]->pkt_len<BUFFER_PKT_SIZE){
+				n = rte_eth_tx_burst(PORT_TO_SERVER, small_queue, &pkts_burst[i], 1);
+				while(n<1){ 
+					tmpn= rte_eth_tx_burst(PORT_TO_SERVER, small_queue, &pkts_burst[i], 1);
+					n+=tmpn;
 				}
-				
+				nb_small+=n;
+				continue;
 			}
-        }
-		else{
-			count =  rte_ring_count(c2s_receive_queue);
+			stage_emit(&st,c2s_target_output(pkts_burst[i],target),pkts_burst[i]);
 		}
+		if(nb_small)
+			__atomic_fetch_add(&packet_sent_to_server_without_payload,nb_small,__ATOMIC_RELAXED);
+		stage_flush(&st);
     }
-	fprintf(stderr,"lcore %d——c2s_filter:to_sendqueue_num is %d,to_dumpqueue_num is %d,to_dropqueue_num is %d,to the delay queue is %d,to the reframe queue is %d,now the receive ringcount is %d\n"
-				,lcore_id,filter_to_sendqueue_num,filter_to_dumpqueue_num,filter_to_dropqueue_num,filter_to_delayqueue_num,filter_to_reframequeue_num,rte_ring_count(c2s_receive_queue));
+	fprintf(stderr,"lcore %d——c2s_filter:rx %llu,to process and send queues %llu,ring full drop %llu\n"
+				,lcore_id,st.stats.rx,st.stats.tx,st.stats.drop);
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
 
 /* C2S drop worker */
 int c2s_drop_main_loop(){
-	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-	int nb_tx,i,n,enq_num,deq_num,available=0,drop_count=0;
+	struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE];
+	int i,deq_num;
 	unsigned lcore_id;
-    unsigned int count;
+	struct stage st;
 
 	lcore_id = rte_lcore_id();
 	fprintf(stderr,"lcore %d——c2s_dropper\n",lcore_id);
-    count = 0;
+	stage_init(&st,"drop");
+	stage_add_input(&st,c2s_drop_process_queue);
 
     while (!force_quit) {
-		if(likely(count !=0)) {
-			nb_tx=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_tx;
-			deq_num=rte_ring_sc_dequeue_bulk(c2s_drop_process_queue,pkts_burst,nb_tx,&available);
-			if(deq_num==0) {
-				deq_num=rte_ring_sc_dequeue_bulk(c2s_drop_process_queue,pkts_burst,available,NULL);
-			}
-			if(deq_num==0) continue;
-
-			/*process section*/
-			for(i=0;i<deq_num;i++){
-				rte_pktmbuf_free(pkts_burst[i]);
-				drop_count++;
-			}
-    	}
-		if(unlikely(count==0))
-			count =  rte_ring_count(c2s_drop_process_queue);
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		/*process section*/
+		for(i=0;i<deq_num;i++)
+			rte_pktmbuf_free(pkts_burst[i]);
     }
-	fprintf(stderr,"lcore %d——c2s_dropper:drop_count is %d ,now the c2s_drop_process_queue ringcount is %d\n"
-			,lcore_id,drop_count,rte_ring_count(c2s_drop_process_queue));
+	fprintf(stderr,"lcore %d——c2s_dropper:drop_count is %llu ,now the c2s_drop_process_queue ringcount is %d\n"
+			,lcore_id,st.stats.rx,rte_ring_count(c2s_drop_process_queue));
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
 
 /*1 mean reorder,0 mean just send*/
@@ -562,12 +767,10 @@ int delay_check(struct rte_mbuf *m)
 	struct rte_ipv4_hdr *ip_hdr;
 	struct rte_tcp_hdr *tcp_hdr;
 	uint32_t dst_ip,src_ip;
-	struct ts_mbuf *ts_m_del,*ts_m_ins;
-	struct timespec now;
 	eth_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,0);
 	if(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)){
-		vhdr=rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,sizeof(struct rte_ether_hdr));
-		if(vhdr->eth_proto = RTE_BE16(RTE_ETHER_TYPE_IPV4))
+		vhdr=rte_pktmbuf_mtod_offset(m, struct rte_vlan_hdr *,sizeof(struct rte_ether_hdr));
+		if(vhdr->eth_proto == RTE_BE16(RTE_ETHER_TYPE_IPV4))
 			ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_vlan_hdr)+sizeof(struct rte_ether_hdr));
 		else{
 			return 0;
@@ -587,165 +790,136 @@ int delay_check(struct rte_mbuf *m)
 }
 /* C2S delay worker*/
 int c2s_delay_main_loop(){
-	struct rte_mbuf *pkts_burst[MAX_PKT_BURST],*m;
-	int nb_rcv,i,n,tmpn,delay_num,enq_num,deq_num,delay_count=0;
+	struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE],*m;
+	int i,deq_num,delay_count=0;
 	uint32_t just_send_num=0;
 	unsigned lcore_id;
-    unsigned int count;
-	struct list_node *node;
+	struct timer_wheel *delay_wheel;
+	struct rte_mbuf *ip_pkts[STAGE_BURST_SIZE];
+	struct flow_key keys[STAGE_BURST_SIZE];
+	uint32_t rnd[STAGE_BURST_SIZE];
+	uint8_t park[STAGE_BURST_SIZE];
+	struct crndstate corr;
+	struct flow_table *flows=NULL;
+	struct delay_arena *arena=NULL;
+	char name[RTE_HASH_NAMESIZE];
+	uint64_t now,held_bytes=0,held_pkts=0;
+	struct stage st;
+	unsigned credit,nb_rel,nb_ip,n,j;
+
 	lcore_id = rte_lcore_id();
-	//uint8_t delay_time=15;/*default delay time:ms*/
-	uint64_t delay_add_time;
-    count = 0;
-	minHeap* delay_heap;
-	struct rte_ether_hdr *eth_hdr;
-	struct rte_vlan_hdr *vhdr;
-	struct rte_ipv4_hdr *ip_hdr;
-	struct rte_tcp_hdr *tcp_hdr;
-	uint32_t dst_ip,src_ip;
-	struct ts_mbuf *ts_m_del,*ts_m_ins;
-	struct timespec now;
-	/*init min heap*/
-	delay_heap=MinHeapInit(131072);
-	if(delay_heap==NULL){
+	stage_init(&st,"delay");
+	stage_add_input(&st,c2s_delay_process_queue[st.instance]);
+	/*back to the class ring of its class, the class rate and ceil are charged for it*/
+	c2s_add_class_outputs(&st,0);
+	/*init timer wheel*/
+	delay_wheel=tw_create("delay_wheel",time_now());
+	if(delay_wheel==NULL){
 		fprintf(stderr,"\n\nlcore %d in c2s_delay_main_loop fail!!!!\n\n",lcore_id);
 		exit(-1);
 	}
+	/*successive delays of this instance are correlated, like netem*/
+	init_crandom(&corr,delay_corr);
+	/*the flows of this instance only, nobody else reads or writes the table*/
+	if(delay_rules_on||delay_keep_order){
+		snprintf(name,sizeof(name),"flow_delay_%u",st.instance);
+		flows=flow_table_create(name,flow_table_size/nb_role_instances[LCORE_ROLE_DELAY],
+			rte_lcore_to_socket_id(lcore_id));
+		if(flows==NULL){
+			fprintf(stderr,"\n\nlcore %d flow table of %u flows fail!!!!\n\n",lcore_id,
+				flow_table_size/nb_role_instances[LCORE_ROLE_DELAY]);
+			exit(-1);
+		}
+	}
+	/*long waits go compact into the arena, their mbufs back to the pool*/
+	if(delay_arena_ms&&delay_arena_bytes){
+		snprintf(name,sizeof(name),"delay_arena_%u",st.instance);
+		arena=delay_arena_create(name,rte_lcore_to_socket_id(lcore_id),time_now());
+		if(arena==NULL){
+			fprintf(stderr,"\n\nlcore %d delay arena of %lu bytes fail!!!!\n\n",lcore_id,delay_arena_bytes);
+			exit(-1);
+		}
+	}
 
 	fprintf(stderr,"lcore %d——c2s_delayer\n",lcore_id);
 
-	int i1=0,i2=0;
 	while(!force_quit){
-		if(delay_heap->size>0&&delay_heap->data[1]){
-			clock_gettime(CLOCK_MONOTONIC,&now);
-			if(timespeccmp(&(delay_heap->data[1]->ts),&now, < )){
-				ts_m_del=MinHeapDelete(delay_heap);
-				if(ts_m_del==NULL){
-					fprintf(stderr,"%s %d, delete fail!\n",__func__,__LINE__);
-					exit(-1);		
-				}
-				enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,ts_m_del->mbuf);
-				free(ts_m_del);
-				if(enq_num==0)
-					delay_count+=1;
+		/*release every pkt whose delay is over, as far as the class rings have room*/
+		now=time_now();
+		if(arena!=NULL)
+			delay_arena_release(arena,now,delay_wheel);
+		credit=stage_credit(&st);
+		do{
+			nb_rel=tw_expire(delay_wheel,now,pkts_burst,RTE_MIN(credit,(unsigned)STAGE_BURST_SIZE));
+			for(i=0;i<nb_rel;i++){
+				held_bytes-=wire_len(pkts_burst[i]->pkt_len);
+				stage_emit(&st,pkt_meta(pkts_burst[i])->cls,pkts_burst[i]);
 			}
-		}
-		if(likely(count !=0)) {
-			//nb_rcv=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			nb_rcv=1;
-			count-=nb_rcv;
-			deq_num=rte_ring_mc_dequeue_bulk(c2s_delay_process_queue, pkts_burst,nb_rcv,NULL);
-			if (unlikely(deq_num==0)){//cause deq_num is 0 either nb_rcv,if deq_num==0,then continue
-				count=0;
+			held_pkts-=nb_rel;
+			credit-=nb_rel;
+			delay_count+=nb_rel;
+		}while(nb_rel==STAGE_BURST_SIZE);
+
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		nb_ip=0;
+		for(i=0;i<deq_num;i++){
+			m = pkts_burst[i];
+			if(flow_key_get(m,&keys[nb_ip])<0){
+				stage_emit(&st,pkt_meta(m)->cls,m);
+				just_send_num+=1;
 				continue;
-			} 
-			for(i=0;i<deq_num;i++){
-				m = pkts_burst[i];
-        			eth_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,0);
-				if(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)){
-					vhdr=rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,sizeof(struct rte_ether_hdr));
-					if(vhdr->eth_proto = RTE_BE16(RTE_ETHER_TYPE_IPV4))
-						ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_vlan_hdr)+sizeof(struct rte_ether_hdr));
-					else{
-						enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,m);
-						if(enq_num==0)
-							just_send_num+=1;				
-							continue;
-					}
-		
-				}
-				else if (eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
-        				ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_ether_hdr));
-				else{
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,m);
-					if(enq_num==0)
-						just_send_num+=1;
-					continue;
-				}
-				//dst_ip = rte_be_to_cpu_32(ip_hdr->dst_addr);
-        		src_ip = rte_be_to_cpu_32(ip_hdr->src_addr);
-				ts_m_ins=(struct ts_mbuf *)malloc(sizeof(struct ts_mbuf));
-				
-				clock_gettime(CLOCK_MONOTONIC,&(ts_m_ins->ts));
-				//fprintf(stderr,"insert %d ,now_sec is %lld, now_nec is %lld \n",i1,ts_m_ins->ts.tv_sec,ts_m_ins->ts.tv_nsec);
-				timespec_add_ns(&(ts_m_ins->ts),delay_pool->table[src_ip%(1<<(32-DELAY_IP_MASK))]);
-				//fprintf(stderr,"insert %d ,delay_sec is %lld, delay_nec is %lld\n",i1++,ts_m_ins->ts.tv_sec,ts_m_ins->ts.tv_nsec);
-				delay_dist->table[src_ip%(1<<(32-DELAY_IP_MASK))]++;
-				/*
-				int tmp_706=get_dist_rand(DELAY_MEAN,DELAY_JITTER/4,NULL,NULL);
-				timespec_add_ns(&(ts_m_ins->ts),tmp_706);
-				*/
-				
-				//timespec_add_ns(&(ts_m_ins->ts),DELAY_MEAN);
-				ts_m_ins->mbuf=m;
-				if(!MinHeapInsert(delay_heap, ts_m_ins)){
-					fprintf(stderr,"%s %d, insert fail!\n",__func__,__LINE__);
-					exit(-1);	
-				}
 			}
-
-		#if 0
-     		struct rte_ether_hdr *eth_hdr;
-			struct rte_tcp_hdr *tcp_hdr;
-     		int tmpj=0;
-     		uint32_t dst_ip,src_ip;
-     		struct rte_ether_addr dst_mac,src_mac;
-     		for(;tmpj<nb_rx;tmpj++){
-        		struct rte_mbuf *m = pkts_burst[tmpj];
-        		eth_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,0);
-        		ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_ether_hdr));
-        		char buf[RTE_ETHER_ADDR_FMT_SIZE];
-        		dst_mac= eth_hdr->d_addr;
-        		src_mac= eth_hdr->s_addr;
-        		rte_ether_format_addr(buf, RTE_ETHER_ADDR_FMT_SIZE, &dst_mac);
-	    		printf("dst mac is %s,",buf);
-        		rte_ether_format_addr(buf, RTE_ETHER_ADDR_FMT_SIZE, &src_mac);
-	    		printf("src mac is %s,", buf);        
-        		dst_ip = rte_be_to_cpu_32(ip_hdr->dst_addr);
-        		src_ip = rte_be_to_cpu_32(ip_hdr->src_addr);
-        		printf("dst ip  %d.%d.%d.%d ,src ip  %d.%d.%d.%d from port %d\n",
-        		dst_ip >> 24 & 0xff,dst_ip>>16 & 0xff,dst_ip>>8 & 0xff,dst_ip& 0xff,     
-        		src_ip >> 24 & 0xff,src_ip>>16 & 0xff,src_ip>>8 & 0xff,src_ip& 0xff, 
-        		portid);
-     		}
-		#endif
-        }
-		if(unlikely(count==0)){
-			count =  rte_ring_count(c2s_delay_process_queue);
+			/*admission: the line holds rate x longest delay, past that drop and count*/
+			if(held_pkts>=delay_line_pkts||held_bytes+wire_len(m->pkt_len)>delay_line_bytes){
+				rte_pktmbuf_free(m);
+				st.stats.refused++;
+				continue;
+			}
+			held_pkts++;
+			held_bytes+=wire_len(m->pkt_len);
+			ip_pkts[nb_ip++]=m;
 		}
-	}
-	/*
-	if(DIST_FLAG==3){
-		for(i=0;i<delay_dist->size;i++){
-            fprintf(stderr,"%s,dist->%d is %lld\n",__func__,i,delay_dist->table[i]);
-        }
-	}
-	*/
-	fprintf(stderr,"lcore %d——c2s_delayer:delay_count is %d ,now the c2s_delay_process_queue ringcount is %d,delay_heap size is %d\n"
-			,lcore_id,delay_count,rte_ring_count(c2s_delay_process_queue),delay_heap->size);
-}
-
-void inspect_stream_table(){
-	int i;
-	struct timespec now;
-	struct ts_mbuf *ts_tmp;
-	for(i=0;i<reorder_table->size;i++){
-		clock_gettime(CLOCK_MONOTONIC,&now);
-		if(reorder_table->stacks[i]!=NULL){
-			if(reorder_table->stacks[i]->oldest!=NULL){
-				if(timespeccmp(reorder_table->stacks[i]->oldest, &now, > )){
-					while(ts_mbuf_stack_size(reorder_table->stacks[i])>0){
-						ts_tmp=ts_mbuf_stack_pop(reorder_table->stacks[i]);
-						rte_ring_mp_enqueue(c2s_send_queue_highpri,ts_tmp->mbuf);
-						//free(ts_tmp->ts);
-						free(ts_tmp);
-					}
-				}
+		for(j=0;j<nb_ip;j++)
+			rnd[j]=get_crandom(&corr);
+		if(flows!=NULL){
+			for(j=0;j<nb_ip;j+=n){
+				n=RTE_MIN(nb_ip-j,(unsigned)RTE_HASH_LOOKUP_BULK_MAX);
+				flow_delay_bulk(flows,&keys[j],&ip_pkts[j],&rnd[j],n,now,arena!=NULL?&park[j]:NULL);
 			}
+			flow_table_age(flows,now);
 		}
-
+		else{
+			/*per pkt jitter, a flow may be reordered by it*/
+			for(j=0;j<nb_ip;j++){
+				m=ip_pkts[j];
+				/*the delay counts from rx, time spent in the filter and rings is part of it*/
+				pkt_meta(m)->deadline=pkt_meta(m)->arrival_tsc+ns_to_tsc(delay_profile_draw(&delay_profiles[0],rnd[j]));
+				park[j]=arena!=NULL&&delay_arena_wants(pkt_meta(m)->deadline,now);
+			}
+		}
+		for(j=0;j<nb_ip;j++){
+			if(arena!=NULL&&park[j]&&delay_arena_park(arena,ip_pkts[j])==0)
+				continue;
+			tw_insert(delay_wheel,ip_pkts[j]);
+		}
+		stage_flush(&st);
 	}
+	fprintf(stderr,"lcore %d——c2s_delayer:delay_count is %d ,just_send_num is %u,ring full drop %llu,line full drop %llu,now the c2s_delay_process_queue ringcount is %d,delay_wheel holds %llu (fifo in %llu,wheel in %llu)\n"
+			,lcore_id,delay_count,just_send_num,st.stats.drop,st.stats.refused,rte_ring_count(st.in[0]),tw_count(delay_wheel),delay_wheel->nb_fifo_in,delay_wheel->nb_wheel_in);
+	if(flows!=NULL){
+		fprintf(stderr,"lcore %d——c2s_delayer:flows %d, new %lu, aged %lu, table full %lu, held for order %lu\n",
+			lcore_id,rte_hash_count(flows->h),flows->nb_new,flows->nb_aged,flows->nb_full,flows->nb_floored);
+		for(i=0;i<DELAY_MAX_PROFILES;i++)
+			if(flows->pkts[i]!=0)
+				fprintf(stderr,"lcore %d——c2s_delayer:profile %d pkts %lu\n",lcore_id,i,flows->pkts[i]);
+	}
+	if(arena!=NULL)
+		fprintf(stderr,"lcore %d——c2s_delayer:arena parked %lu, holds %lu in %lu bytes, kept as mbuf %lu, short of mbufs %lu\n",
+			lcore_id,arena->nb_parked,arena->parked,arena->used,arena->nb_full,arena->nb_nombuf);
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
+
 /*1 mean reorder,0 mean just send*/
 int reorder_check(struct rte_mbuf *m)
 {
@@ -754,12 +928,10 @@ int reorder_check(struct rte_mbuf *m)
 	struct rte_ipv4_hdr *ip_hdr;
 	struct rte_tcp_hdr *tcp_hdr;
 	uint32_t dst_ip,src_ip;
-	struct ts_mbuf *ts_m_del,*ts_m_ins;
-	struct timespec now;
 	eth_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,0);
 	if(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)){
-		vhdr=rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,sizeof(struct rte_ether_hdr));
-		if(vhdr->eth_proto = RTE_BE16(RTE_ETHER_TYPE_IPV4))
+		vhdr=rte_pktmbuf_mtod_offset(m, struct rte_vlan_hdr *,sizeof(struct rte_ether_hdr));
+		if(vhdr->eth_proto == RTE_BE16(RTE_ETHER_TYPE_IPV4))
 			ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_vlan_hdr)+sizeof(struct rte_ether_hdr));
 		else{
 			return 0;
@@ -778,260 +950,68 @@ int reorder_check(struct rte_mbuf *m)
 	return 0;
 }
 int c2s_reorder_main_loop(){
-	
-	struct rte_mbuf *pkts_burst[MAX_PKT_BURST],*m,*tmp;
-	struct ts_mbuf *ts_m,*ts_tmp;
-	int nb_rcv,i,n,deq_num,status,enq_num,it;
-	uint32_t just_send_num=0,reorder_num=0,put_delay_num=0;
+	struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE],*m;
+	struct flow_key key;
+	struct reorder_engine *re;
+	char name[RTE_HASH_NAMESIZE];
+	uint32_t just_send_num=0;
 	unsigned lcore_id;
-    unsigned int count;
-	lcore_id = rte_lcore_id();
-
-    count = 0;
-	struct rte_ether_hdr *eth_hdr;
-	struct rte_vlan_hdr *vhdr;
-	struct rte_ipv4_hdr *ip_hdr;
-	struct rte_tcp_hdr *tcp_hdr;
-	uint32_t dst_ip,src_ip;
-	uint16_t dst_port,src_port;
-	struct ts_mbuf *ts_m_del,*ts_m_ins;
-	struct timespec now;
-	//map_elem_t *last;
-
-	uint64_t prev_tsc, diff_tsc, cur_tsc, timer_tsc;
-	uint64_t timer_period = 0.3 * rte_get_timer_hz();//0.3 second
-	const uint64_t drain_tsc = ((rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S) * BURST_TX_DRAIN_US;
-	prev_tsc = 0;
-	timer_tsc = 0;
+	uint64_t now;
+	struct stage st;
+	int i,deq_num;
 
-	/*stream table init*/
-	/*
-	reorder_table->size=HASH_STREAM_TABLE_SIZE;
-	reorder_table=(reorder_table_t *)malloc(sizeof(reorder_table_t)+reorder_table->size*sizeof(map_t));
-	for(i=0;i<reorder_table->size;i++){
-		reorder_table->bucket[i]=map_init(reorder_table->bucket[i],BUCKET_CAPACITY);
-	}
-	*/
-	//reorder_table=(reorder_table_t *)malloc(sizeof(reorder_table_t)+(REORDER_IP_MAX-REORDER_IP_MIN+1)*sizeof(ts_mbuf_stack*));
-	reorder_table=(reorder_table_t *)malloc(sizeof(reorder_table_t));
-	if(reorder_table==NULL) {
-		fprintf(stderr,"%s %d malloc fail!",__func__,__LINE__);
+	lcore_id = rte_lcore_id();
+	stage_init(&st,"reorder");
+	stage_add_input(&st,c2s_reorder_process_queue[st.instance]);
+	c2s_add_class_outputs(&st,0);
+	/*flat per flow state, allocated once, held pkts are chained through their pkt_meta*/
+	snprintf(name,sizeof(name),"reorder_%u",st.instance);
+	re=reorder_engine_create(name,rte_lcore_to_socket_id(lcore_id),time_now());
+	if(re==NULL){
+		fprintf(stderr,"\n\nlcore %d reorder table of %d flows fail!!!!\n\n",lcore_id,REORDER_FLOWS);
 		exit(-1);
 	}
-
-	#ifdef TCP_CRR
-	uint32_t reorder_counter[65535];
-	uint32_t all_counter[65535];
-	float reorder_ratio[65535];
-	reorder_table->stacks=(ts_mbuf_stack **)malloc((65535)*sizeof(ts_mbuf_stack*));
-
-	if(reorder_table->stacks==NULL){
-		fprintf(stderr,"%s %d malloc fail!",__func__,__LINE__);
-                exit(-1);
-	}
-	reorder_table->size=65535;
-	for(i=0;i<65535;i++){
-		reorder_table->stacks[i]=(ts_mbuf_stack*)malloc(sizeof(ts_mbuf_stack));
-		if(reorder_table->stacks[i]==NULL){
-			fprintf(stderr,"%s %d malloc fail!",__func__,__LINE__);
-                	exit(-1);
-		}
-		ts_mbuf_stack_init(reorder_table->stacks[i],REORDER_STACK_LEVEL);
-		reorder_counter[i]=0;
-		all_counter[i]=0;
-		reorder_ratio[i]=0;
-	}
-	#else
-	uint16_t reorder_counter[REORDER_IP_MAX-REORDER_IP_MIN+1];
-	uint16_t all_counter[REORDER_IP_MAX-REORDER_IP_MIN+1];
-	float reorder_ratio[REORDER_IP_MAX-REORDER_IP_MIN+1];
-	reorder_table->stacks=(ts_mbuf_stack **)malloc((REORDER_IP_MAX-REORDER_IP_MIN+1)*sizeof(ts_mbuf_stack*));
-	
-	if(reorder_table->stacks==NULL){
-		fprintf(stderr,"%s %d malloc fail!",__func__,__LINE__);
-                exit(-1);
-	}
-	reorder_table->size=REORDER_IP_MAX-REORDER_IP_MIN+1;
-	for(i=0;i<=REORDER_IP_MAX-REORDER_IP_MIN;i++){
-		reorder_table->stacks[i]=(ts_mbuf_stack*)malloc(sizeof(ts_mbuf_stack));
-		if(reorder_table->stacks[i]==NULL){
-			fprintf(stderr,"%s %d malloc fail!",__func__,__LINE__);
-                	exit(-1);
-		}
-		ts_mbuf_stack_init(reorder_table->stacks[i],REORDER_STACK_LEVEL);
-		reorder_counter[i]=0;
-		all_counter[i]=0;
-		reorder_ratio[i]=0;
-	}
-	#endif
+	fprintf(stderr,"lcore %d——c2s_reorderer\n",lcore_id);
 
 	while(!force_quit){
-		if(likely(count !=0)) {
-			nb_rcv=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_rcv;
-			deq_num=rte_ring_mc_dequeue_bulk(c2s_reorder_process_queue, pkts_burst,nb_rcv,NULL);
-			if (unlikely(deq_num==0)){//cause deq_num is 0 either nb_rcv,if deq_num==0,then continue
-				count=0;
-                continue;
-			} 
-			for(i=0;i<deq_num;i++){
-				m = pkts_burst[i];
-        		eth_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,0);
-				if(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)){
-					struct rte_vlan_hdr *vhdr=rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr *,sizeof(struct rte_ether_hdr));
-					if(vhdr->eth_proto = RTE_BE16(RTE_ETHER_TYPE_IPV4))
-						ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_vlan_hdr)+sizeof(struct rte_ether_hdr));
-					else{
-						enq_num=rte_ring_mp_enqueue(c2s_send_queue,m);
-					}
-				}
-				else if(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
-        			ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *,sizeof(struct rte_ether_hdr));
-				else{
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue,m);
-					just_send_num+=enq_num;
-				}
-				//dst_ip = rte_be_to_cpu_32(ip_hdr->dst_addr);
-        		src_ip = rte_be_to_cpu_32(ip_hdr->src_addr);
-				//ts_mbuf_stack_push(reorder_table->stacks[src_ip%reorder_table->size],m);
-				#ifdef TCP_CRR
-				if (ip_hdr->next_proto_id == IPPROTO_TCP){
-					tcp_hdr= rte_pktmbuf_mtod_offset(m,struct rte_tcp_hdr *,sizeof(struct rte_vlan_hdr)+sizeof(struct rte_ether_hdr)+sizeof(struct rte_ipv4_hdr));
-				}
-				else{
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue,m);
-					just_send_num+=enq_num;
-				}
-				src_port=rte_be_to_cpu_16(tcp_hdr->src_port);
-				it=src_port%reorder_table->size;
-				if(reorder_ratio[it]<REORDER_RATIO){
-					if(1+ts_mbuf_stack_size(reorder_table->stacks[it])>=reorder_table->stacks[it]->capacity){
-						enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,m);
-						while(ts_mbuf_stack_size(reorder_table->stacks[it])>0){
-							ts_tmp=ts_mbuf_stack_pop(reorder_table->stacks[it]);
-							if(ts_tmp->mbuf==NULL){
-								fprintf(stderr,"%s %d pop fail!",__func__,__LINE__);
-								exit(-1);
-							}
-							enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,ts_tmp->mbuf);
-							free(ts_tmp);
-							reorder_counter[it]+=2;
-							all_counter[it]+=2;
-							if(all_counter[it]==0){
-								reorder_counter[it]=0;
-								all_counter[it]=1/REORDER_RATIO;
-							}
-							reorder_ratio[it]=reorder_counter[it]/all_counter[it];
-						}
-					}
-					else{
-						struct ts_mbuf *ts_m_push=(struct ts_mbuf *)malloc(sizeof(struct ts_mbuf));
-						//ts_m_push->ts=(struct timespec *)malloc(sizeof(struct timespec));
-						clock_gettime(CLOCK_MONOTONIC,&(ts_m_push->ts));
-						/*
-						struct timespec *tmpspec;
-						ts_m_ins->ts->tv_nsec=300;
-						ts_m_ins->ts->tv_sec=0;
-						*/
-						timespec_add_ns(&(ts_m_push->ts),REORDER_STACK_TIMER);
-						ts_m_push->mbuf=m;
-						ts_mbuf_stack_push(reorder_table->stacks[it],ts_m_push);
-					}
-				}
-				else{
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue,m);
-					all_counter[it]++;
-					if(all_counter[it]==0){
-						reorder_counter[it]=0;
-						all_counter[it]=1/REORDER_RATIO;
-					}
-					reorder_ratio[it]=reorder_counter[it]/all_counter[it];
-				}
-				#else
-				it=src_ip%reorder_table->size;
-				if(reorder_ratio[it]<REORDER_RATIO){
-					if(1+ts_mbuf_stack_size(reorder_table->stacks[it])>=reorder_table->stacks[it]->capacity){
-						enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,m);
-						while(ts_mbuf_stack_size(reorder_table->stacks[it])>0){
-							ts_tmp=ts_mbuf_stack_pop(reorder_table->stacks[it]);
-							if(ts_tmp->mbuf==NULL){
-								fprintf(stderr,"%s %d pop fail!",__func__,__LINE__);
-								exit(-1);
-							}
-							enq_num=rte_ring_mp_enqueue(c2s_send_queue_highpri,ts_tmp->mbuf);
-							free(ts_tmp);
-							reorder_counter[it]+=2;
-							all_counter[it]+=2;
-							if(all_counter[it]==0){
-								reorder_counter[it]=0;
-								all_counter[it]=1/REORDER_RATIO;
-							}
-							reorder_ratio[it]=reorder_counter[it]/all_counter[it];
-						}
-					}
-					else{
-						struct ts_mbuf *ts_m_push=(struct ts_mbuf *)malloc(sizeof(struct ts_mbuf));
-						//ts_m_push->ts=(struct timespec *)malloc(sizeof(struct timespec));
-						clock_gettime(CLOCK_MONOTONIC,&(ts_m_push->ts));
-						/*
-						struct timespec *tmpspec;
-						ts_m_ins->ts->tv_nsec=300;
-						ts_m_ins->ts->tv_sec=0;
-						*/
-						timespec_add_ns(&(ts_m_push->ts),REORDER_STACK_TIMER);
-						ts_m_push->mbuf=m;
-						ts_mbuf_stack_push(reorder_table->stacks[it],ts_m_push);
-					}
-				}
-				else{
-					enq_num=rte_ring_mp_enqueue(c2s_send_queue,m);
-					all_counter[it]++;
-					if(all_counter[it]==0){
-						reorder_counter[it]=0;
-						all_counter[it]=1/REORDER_RATIO;
-					}
-					reorder_ratio[it]=reorder_counter[it]/all_counter[it];
-				}
-				#endif
-			}
-		}
-	
-		if(unlikely(count==0)){
-			count =  rte_ring_count(c2s_reorder_process_queue);
-		}
-		cur_tsc = rte_rdtsc();
-		diff_tsc = cur_tsc - prev_tsc;
-		if (unlikely(diff_tsc > drain_tsc)) {
-			/* if timer is enabled */
-			if (timer_period > 0) {
-				/* advance the timer */
-				timer_tsc += diff_tsc;
-				/* if timer has reached its timeout */
-				if (unlikely(timer_tsc >= timer_period)) {
-					inspect_stream_table();
-					/* reset the timer */
-					timer_tsc = 0;	
-				}
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		now=time_now();
+		for(i=0;i<deq_num;i++){
+			m = pkts_burst[i];
+			if(flow_key_get(m,&key)<0){
+				stage_emit(&st,REORDER_OUT_SEND(m),m);
+				just_send_num+=1;
+				continue;
 			}
-			prev_tsc = cur_tsc;
+			reorder_pkt(re,&st,m,rte_hash_crc(&key,sizeof(key),0),(uint32_t)(lrand()>>32),now);
 		}
-
+		/*flows whose held pkts are due, no table scan*/
+		reorder_expire(re,&st,now);
+		stage_flush(&st);
 	}
+	fprintf(stderr,"lcore %d——c2s_reorderer:rx %llu,just_send_num is %u,ring full drop %llu\n",
+		lcore_id,st.stats.rx,just_send_num,st.stats.drop);
+	fprintf(stderr,"lcore %d——c2s_reorderer:pkts %lu, reordered %lu (%.4f), held to the timer %lu\n",
+		lcore_id,re->nb_pkts,re->nb_reordered,
+		re->nb_pkts?(double)re->nb_reordered/re->nb_pkts:0.0,re->nb_expired);
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
 /*C2S timestamp dump core*/
 int c2s_dump_main_loop(){
-	struct rte_mbuf *pkts_burst[MAX_PKT_BURST],*m;
-	int nb_tx,i,n,enq_num,deq_num,dump_to_sendqueue=0,available=0;
+	struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE];
+	int i,deq_num;
 	int pkt_gap,burst_width;//ms
 	int times=1;
 	unsigned lcore_id;
-    unsigned int count;
-	struct timeval start,end,last,now;
-	struct list_node *node;
+	uint64_t start,end,last,now;
+	struct stage st;
 	lcore_id = rte_lcore_id();
-    count = 0;
 	
 	fprintf(stderr,"lcore %d——c2s_dumper\n",lcore_id);
+	stage_init(&st,"dump");
+	stage_add_input(&st,c2s_dump_process_queue);
+	c2s_add_class_outputs(&st,0);
 	
     FILE *file = fopen("./burst-width.txt", "a");
     if(file == NULL)
@@ -1040,43 +1020,35 @@ int c2s_dump_main_loop(){
         exit(-1);
     }
 
-	gettimeofday(&start,NULL);
+	start=now=time_now();
     while (!force_quit) {
-		if(likely(count !=0)) {
-			nb_tx=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_tx;
-			deq_num=rte_ring_sc_dequeue_bulk(c2s_dump_process_queue,pkts_burst,nb_tx,&available);
-			if(deq_num==0) {
-				deq_num=rte_ring_sc_dequeue_bulk(c2s_dump_process_queue,pkts_burst,available,NULL);
-			}
-			if(deq_num==0) continue;
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		if(deq_num!=0) {
 
 			/*process section*/
 			last=now;
-			gettimeofday(&now,NULL);
-			pkt_gap=width_compute(&last,&now);
+			now=time_now();
+			pkt_gap=tsc_to_ms(now-last);
 			if(pkt_gap>=400)
-			//if(belong_to_one_burst(&last,&now)!=0)//diffrence greater than 700ms
-			{			
+			{
 				//fprintf(file, "burst %d,width is %d\n", times,burst_width);
 				end=last;
-				burst_width=width_compute(&start,&end);
-				//fprintf(file, "start sec is  %d , usec is %d ,end sec is  %d , usec is %d ,\n", start.tv_sec,start.tv_usec,end.tv_sec,end.tv_usec);
-				fprintf(file, "sec %d, burst %d,width is %d\n",now.tv_sec, times,burst_width);
+				burst_width=tsc_to_ms(end-start);
+				fprintf(file, "sec %lu, burst %d,width is %d\n",time_wall_sec(now), times,burst_width);
 				fflush(file);
 				start=now;
 				times++;
 			}
 
-			enq_num=rte_ring_mp_enqueue_bulk(c2s_send_queue, pkts_burst,deq_num,NULL);
-			dump_to_sendqueue+=enq_num;
+			for(i=0;i<deq_num;i++)
+				stage_emit(&st,pkt_meta(pkts_burst[i])->cls,pkts_burst[i]);
+			stage_flush(&st);
         }
-		if(unlikely(count==0)){
-			count =  rte_ring_count(c2s_dump_process_queue);
-		}	
 	}
-	fprintf(stderr,"lcore %d——c2s_dumper:c2s_dump_main_loop,dump_to_sendqueue is %d,now the dumpqueue ringcount is %d\n"
-			,lcore_id,dump_to_sendqueue,rte_ring_count(c2s_dump_process_queue));
+	fprintf(stderr,"lcore %d——c2s_dumper:c2s_dump_main_loop,dump_to_sendqueue is %llu,now the dumpqueue ringcount is %d\n"
+			,lcore_id,st.stats.tx,rte_ring_count(c2s_dump_process_queue));
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
 
 /*C2S policy maker*/
@@ -1084,122 +1056,56 @@ int c2s_policy_main_loop(){
 
 	int current_count,last_count,change_count;
 	change_count=last_count=current_count=0;
-	timer_t timerid; 
-    struct sigevent evp; 
-    struct sigaction act; 
+	/*end of the buffer time, polled on the tsc instead of a posix timer and signal*/
+	uint64_t buffer_deadline=0;
+	const uint64_t buffer_tsc=ms_to_tsc(BUFFER_TIME);
 	timing=FALSE;//state of if timer start,timing TRUE mean storaging packets,FALSE mean we are sending packet or no packet in
 	fprintf(stderr,"lcore %d——c2s policy maker\n",rte_lcore_id());
-    memset(&act, 0, sizeof(act)); 
-    act.sa_handler = due_timer_handler; 
-    act.sa_flags = 0; 
-    sigemptyset(&act.sa_mask); 
-    if (sigaction(DUE_TIMER_SIG, &act, NULL) == -1) 
-    { 
-        perror("fail to sigaction"); 
-        exit(-1); 
-    } 
-
-    memset(&evp, 0, sizeof(struct sigevent)); 
-    evp.sigev_signo = DUE_TIMER_SIG; 
-    evp.sigev_notify = SIGEV_SIGNAL; 
-    if (timer_create(CLOCK_REALTIME, &evp, &timerid) == -1) 
-    { 
-        perror("fail to timer_create"); 
-        exit(-1); 
-    } 
-
-    struct itimerspec it; 
-    it.it_interval.tv_sec = 0; 
-    it.it_interval.tv_nsec = 0; 
-    it.it_value.tv_sec = 0; 
-    it.it_value.tv_nsec = BUFFER_TIME*1000000;
-
-
-	#ifndef DIST_MODE //正常模式缓冲
+
+
+	uint64_t now;
 	current_rate=RATE_CONTROL*1.0;
+	#ifdef DIST_MODE//速率变化的模式
+	if(rate_profile==NULL)
+		rate_profile=rate_profile_dist_mode();
+	#endif
 	while (!force_quit) {
-		current_count =  rte_ring_count(c2s_send_queue)+rte_ring_count(c2s_send_queue_highpri);
+		if(timing==TRUE && time_now()>=buffer_deadline){//buffer end
+			send_state = TRUE;
+			timing=FALSE;
+		}
+		/*
+		* rate profile: its clock starts with the first send and then runs on,
+		* the rate is set when the tsc passes the next point, not on a timer period
+		*/
+		if(rate_profile!=NULL && !rate_profile->done){
+			now=time_now();
+			if(rate_profile->start==0 && send_state==TRUE)
+				rate_profile_start(rate_profile,now);
+			if(rate_profile->start!=0 && now>=rate_profile->next){
+				current_rate=rate_profile_rate(rate_profile,now);
+				#ifdef DEBUG
+				fprintf(stderr,"policy maker point %u, current_rate was set to %f\n",rate_profile->cur,current_rate);
+				#endif
+			}
+		}
+		current_count =  c2s_class_count();
 		if(current_count!=0 && timing==FALSE && send_state==FALSE){//here , bursts start get in
 			timing=TRUE;
-    		if (timer_settime(timerid, 0, &it, 0) == -1) { 
-        		perror("fail to timer_settime"); 
-        		exit(-1); 
-			}
+			buffer_deadline=time_now()+buffer_tsc;
 		}
 
 		#ifdef RING_THRESHOLD
 		if(current_count>=RING_THRESHOLD ){//here , bursts start get in
 			send_state=TRUE;
-			if (timer_settime(timerid, 0, &it, 0) == -1) { 
-        		perror("fail to get rid of timer"); 
-        		exit(-1); 
-			}
+			timing=TRUE;
+			buffer_deadline=time_now()+buffer_tsc;
 		}
 		#endif
 		if(current_count==0 && timing==FALSE  && send_state==TRUE ){
 			send_state=FALSE;
 		}
 	}
-	#else//速率变化的模式
-	unsigned lcore_id,i=0;
-	uint64_t prev_tsc, diff_tsc, cur_tsc, timer_tsc;
-	uint64_t timer_period = (uint64_t)(0.0005 * rte_get_timer_hz());//1==1s.0.001==1ms
-	const uint64_t drain_tsc = ((rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S) * BURST_TX_DRAIN_US;
-	prev_tsc = 0;
-	timer_tsc = 0;
-	while (!force_quit) {
-		if(send_state==TRUE){
-			cur_tsc = rte_rdtsc();
-			diff_tsc = cur_tsc - prev_tsc;
-			if (unlikely(diff_tsc > drain_tsc)) {
-				/* if timer is enabled */
-				if (timer_period > 0) {
-					/* advance the timer */
-					timer_tsc += diff_tsc;
-					/* if timer has reached its timeout */
-					if (unlikely(timer_tsc >= timer_period)) {
-						/*update current rate*/
-
-						//current_rate=(shaping_dist->table[i]-shaping_min*1.0)/(shaping_max-shaping_min*1.0)*100.0;//shrink the table's value to 0~10000
-						//current_rate=( (double)( (int)( (current_rate+0.005)*100 ) ) )/100;//keep two significant digits
-						i++;
-						if((6+i*1.10)<100){
-							current_rate=(6+i*1.10);
-						}
-						else if((6+i*1.10)>=100){
-							current_rate=(100-((6+i*1.10)-100));
-							if((100-((6+i*1.10)-100))<=10){
-								send_state=FALSE;
-								i=0;
-								//fprintf(stderr,"policy maker stop send \n");
-							}
-						}
-						fprintf(stderr,"policy maker i is %d, current_rate was set to %f\n",i,current_rate);
-						//fprintf(stderr,"policy maker shaping_dist->table[%d] is %d, current_rate was set to %f\n",i,shaping_dist->table[i],current_rate);
-						//i++;
-						//if(i>=shaping_dist->size)
-						//	i=0;
-
-						/* reset the timer */
-						timer_tsc = 0;	
-					}
-				}
-				prev_tsc = cur_tsc;
-			}
-		}
-		current_count =  rte_ring_count(c2s_send_queue);
-		if(current_count!=0 && timing==FALSE && send_state==FALSE){//here , bursts start get in
-			timing=TRUE;
-    		if (timer_settime(timerid, 0, &it, 0) == -1) { 
-        		perror("fail to timer_settime"); 
-        		exit(-1); 
-			}
-		}
-		if(current_count==0  && timing==FALSE  && send_state==TRUE ){
-			send_state=FALSE;
-		}
-	}
-	#endif
 
 	fprintf(stderr,"lcore %d——c2s policy maker:finished\n",rte_lcore_id());
 	return 0;
@@ -1230,33 +1136,206 @@ void move_all_pkt(struct rte_ring * src,struct rte_ring * dst){
 	}
 }
 
+/*draw the next pkt gap and put it on the time line*/
+static inline void
+gap_slot_make(struct gap_slot *s,uint64_t *timeline)
+{
+	int64_t gap=dist_sample(gap_sampler,get_crandom(&gap_corr));//return ns gap
+
+	if(gap<0)
+		gap=0;
+	*timeline+=ns_to_tsc(gap);
+	s->departure=*timeline;
+	s->gap_ns=gap;
+}
+
+/*next gap of the sender, from the gap_gen lcore when there is one; -1 on quit, *s is not set*/
+static inline int
+gap_sched_next(struct gap_slot *s,uint64_t *timeline)
+{
+	if(gap_sched_ring==NULL){
+		gap_slot_make(s,timeline);
+		return 0;
+	}
+	while(gap_sched_dequeue(gap_sched_ring,s)!=0){
+		if(force_quit)
+			return -1;
+		rte_pause();
+	}
+	return 0;
+}
+
+/*
+* wait for the departure of slot s, lead_ns early, *shift maps the producer
+* time line to now: when the sender is behind (idle or late) the time line is
+* shifted to now so the following gaps keep their length.
+* return the departure, 0 when the sender was late and did not wait
+*/
+static inline uint64_t
+gap_wait(const struct gap_slot *s,uint64_t *shift,int64_t lead_ns)
+{
+	uint64_t deadline=s->departure+*shift;
+	uint64_t start=lead_ns>=0?deadline-ns_to_tsc(lead_ns):deadline+ns_to_tsc(-lead_ns);
+	uint64_t now=time_now();
+
+	if(start<now){
+		if(deadline<now)
+			*shift+=now-deadline;
+		return 0;
+	}
+	time_wait_until(start);
+	return deadline;
+}
+
+/* gap producer, fills the gap schedule ring for the c2s sender */
+int gap_gen_main_loop(){
+	struct gap_slot slots[GAP_SCHED_BURST];
+	uint64_t timeline,produced=0;
+	unsigned lcore_id=rte_lcore_id();
+	unsigned i,n;
+
+	fprintf(stderr,"lcore %d——gap_gen\n",lcore_id);
+	init_crandom(&gap_corr,GAP_CORR);
+	timeline=time_now();
+	while(!force_quit){
+		n=RTE_MIN(gap_sched_free_count(gap_sched_ring),(unsigned)GAP_SCHED_BURST);
+		if(n==0){
+			rte_pause();
+			continue;
+		}
+		for(i=0;i<n;i++)
+			gap_slot_make(&slots[i],&timeline);
+		gap_sched_enqueue(gap_sched_ring,slots,n);
+		produced+=n;
+	}
+	fprintf(stderr,"lcore %d——gap_gen:gaps produced %llu\n",lcore_id,produced);
+	return 0;
+}
+
+/*
+* send the whole burst, void pkts keep the spacing so nothing may be dropped.
+* return 1 when the tx ring was full and the burst had to wait for the wire
+*/
+static inline int
+c2s_tx_flush(struct rte_mbuf **send_burst,int nb_tx)
+{
+	int n,tmpn;
+
+	n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,send_burst,nb_tx);
+	if(n==nb_tx)
+		return 0;
+	while(n<nb_tx){
+		tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&send_burst[n],nb_tx-n);
+		n+=tmpn;
+	}
+	return 1;
+}
+
+/*
+* flush a train of the void pkt sender and learn from it: when this flush and
+* the one before both waited for the wire, the time between them is the wire
+* time of this train, the error per gap goes to the bucket of the mean pkt size
+*/
+static inline void
+c2s_train_flush(struct gap_calib *c,struct rte_mbuf **send_burst,int nb_tx,uint64_t *flush_end,
+		uint64_t *train_ns,uint64_t *train_wire,unsigned *train_gaps)
+{
+	uint64_t now;
+
+	if(c2s_tx_flush(send_burst,nb_tx)==0){
+		*flush_end=0;
+	}
+	else{
+		now=time_now();
+		if(*flush_end!=0&&*train_gaps!=0)
+			gap_calib_update(c,gap_calib_bucket(*train_wire / *train_gaps),
+				(gap_calib_diff_ns(now,*flush_end)-(int64_t)*train_ns)/(int64_t)*train_gaps);
+		*flush_end=now;
+	}
+	*train_ns=0;
+	*train_wire=0;
+	*train_gaps=0;
+}
+
+/*
+* probe phase of the timer paced sender: void pkts of every size bucket on a
+* fixed gap, the server side drops them, to learn the biases before real pkts
+*/
+static void
+c2s_gap_calib_probe(struct gap_calib *c)
+{
+	static const uint32_t probe_len[GAP_CALIB_BUCKETS]={MIN_VOID_PKT_LEN,400,900,1400};
+	struct rte_mbuf *m;
+	uint64_t deadline,start;
+	int64_t bias;
+	unsigned b,i;
+
+	deadline=time_now();
+	for(b=0;b<GAP_CALIB_BUCKETS&&!force_quit;b++){
+		for(i=0;i<GAP_CALIB_PROBES;i++){
+			deadline+=ns_to_tsc(GAP_CALIB_PROBE_GAP_NS);
+			bias=gap_calib_bias(c,b);
+			start=bias>=0?deadline-ns_to_tsc(bias):deadline+ns_to_tsc(-bias);
+			if(start<time_now()){
+				deadline=time_now();
+				continue;
+			}
+			time_wait_until(start);
+			m=get_void_pkts(1,probe_len[b]);
+			c2s_tx_flush(&m,1);
+			gap_calib_update(c,b,gap_calib_diff_ns(time_now(),deadline));
+		}
+	}
+}
+
+/*
+* wire bytes of void pkts owed after nb pkts of current_len wire bytes:
+* in pps mode every pkt takes a slot of line rate/rate_pps, else the pkts
+* take rate_ratio percent of the line rate
+*/
+static inline double
+c2s_void_owed(int current_len,int nb,double rate_ratio)
+{
+	if(rate_pps!=0)
+		return nb*((double)link_speed_mbps*125000/rate_pps)-current_len;
+	return current_len*100.0/rate_ratio-current_len;
+}
 
 /* C2S ratecontrol sender ,通过掺杂不定长无效包进行控速*/
 int c2s_rate_control_send_main_loop(){
-	if (GAP_DIST_MODE==0){
+	if (c2s_sender==C2S_SENDER_RATE){
 		int deq_default=10000,supply_size=1,send_size=10000;
 		struct rte_mbuf *valid_array[deq_default];
 		struct rte_mbuf *send_burst[send_size];
 		double rate_ratio=RATE_CONTROL*1.0;//Reciprocal 
 		int deq_num=0,available=0;
-		int current_len,total_len,void_len;
-		int void_num,last_void_pkt_len,supply_counter;
+		int current_len,void_len;//wire bytes
 		int valid_head,valid_tail,array_end;
 		int nb_tx,n,tmpn;
 		int queue_flag=0;
+		/*
+		* wire bytes of void pkts owed (>0) or overpaid (<0) by the groups sent so far,
+		* the void pkt sizes and the int maths can not hit the owed bytes exactly
+		*/
+		double void_owed,void_deficit=0;
 
 		unsigned lcore_id= rte_lcore_id();
-		fprintf(stderr,"lcore %d——c2s_rate_control_sender,GAP_DIST_MODE==0\n",lcore_id);
+		if(rate_pps!=0)
+			fprintf(stderr,"lcore %d——c2s_rate_control_sender,rate sender,%llu pps\n",lcore_id,(unsigned long long)rate_pps);
+		else
+			fprintf(stderr,"lcore %d——c2s_rate_control_sender,rate sender\n",lcore_id);
 
-		int i,j,k;
-		for(i=60;i<=MAX_VOID_PKT_LEN;i++){
-			make_void_packs(i,0);
-		}
+		int i,k;
+		struct class_sched sched;
+		class_sched_init(&sched);
 		while (!force_quit) {
 			if(send_state==TRUE){
-					if(rte_ring_count(c2s_send_queue)!=0||rte_ring_count(c2s_send_queue_highpri)!=0) {
+					if(class_sched_count(&sched)!=0) {
 						//dequeue valid pkt
-						if(current_rate>=100){
+						if(rate_pps!=0){
+							//pps mode does not follow current_rate
+						}
+						else if(current_rate>=100){
 							rate_ratio=100;
 							//fprintf(stderr,"1 line %d ,rate_ratio is %f\n",__LINE__,rate_ratio);
 						}
@@ -1270,22 +1349,10 @@ int c2s_rate_control_send_main_loop(){
 							//fprintf(stderr,"3 line %d ,rate_ratio is %f\n",__LINE__,rate_ratio);
 						}
 					
-						if(rte_ring_count(c2s_send_queue_highpri)!=0){
-							deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue_highpri,valid_array,deq_default,&available);
-							if(deq_num==0) {
-								deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue_highpri,valid_array,available,NULL);
-							}
-							if(deq_num==0) continue;
-							queue_flag=1;
-						}
-						else{
-							deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,deq_default,&available);
-							if(deq_num==0) {
-								deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,available,NULL);
-							}
-							if(deq_num==0) continue;
-							queue_flag=2;
-						}
+						//class 0 first, the other classes by DRR
+						deq_num=class_sched_dequeue(&sched,valid_array,deq_default);
+						if(deq_num==0) continue;
+						queue_flag=1;
 					#ifdef DEBUG 
 						fprintf(stderr,"deq_num is %d\n",deq_num);
 					#endif
@@ -1301,10 +1368,10 @@ int c2s_rate_control_send_main_loop(){
 								fprintf(stderr,"%s %d get NULL mbuf, exit!!,get form %d",__func__,__LINE__,queue_flag);
 								exit(-1);
 							}
-							current_len+=valid_array[valid_tail]->pkt_len;
+							current_len+=wire_len(valid_array[valid_tail]->pkt_len);
 							//total_len=(int)(current_len/(100-rate_ratio*1.0));
-							total_len=current_len/(rate_ratio*0.01)-current_len;
-							if(total_len>=60) break;
+							void_owed=c2s_void_owed(current_len,valid_tail-valid_head+1,rate_ratio)+void_deficit;
+							if(void_owed>=wire_len(MIN_VOID_PKT_LEN)) break;
 						}//if the forloop finish , valid_tail is 100;
 					
 						if(unlikely(valid_head==valid_tail&&valid_tail==array_end)){//send over
@@ -1313,9 +1380,12 @@ int c2s_rate_control_send_main_loop(){
 							#endif
 							continue;
 						}
-						if(unlikely(valid_tail==array_end/* && valid_head<valid_tail-1 */&& total_len<60)){//valid_array not enough
-							if(rte_ring_count(c2s_send_queue)==0||rate_ratio==100){//reach the end of the ring , just send;
+						if(unlikely(valid_tail==array_end/* && valid_head<valid_tail-1 */&& void_owed<wire_len(MIN_VOID_PKT_LEN))){//valid_array not enough
+							if(class_sched_count(&sched)==0||(rate_pps==0&&rate_ratio==100)){//reach the end of the ring , just send;
 								nb_tx=valid_tail-valid_head;
+								//the void bytes of these pkts are paid with the next group
+								if(rate_pps!=0||rate_ratio<100)
+									void_deficit=RTE_MAX(void_owed,(double)-wire_len(MAX_VOID_PKT_LEN));
 								#ifdef DEBUG
 								for(k=valid_head;k<valid_tail;k++){
 									fprintf(stderr," line %d ,valid_tail is  %d ,valid_head  is  %d  ,valid_array[%d]->pkt_len is %d \n",
@@ -1342,27 +1412,15 @@ int c2s_rate_control_send_main_loop(){
 								for(i=0;i<valid_tail-valid_head;i++){
 									valid_array[i]=valid_array[valid_head+i];
 								}
-								deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,&valid_array[i],deq_default-i,&available);
+								deq_num=class_sched_dequeue(&sched,&valid_array[i],deq_default-i);
 								#ifdef DEBUG
-									fprintf(stderr," line %d ,valid_tail is %d, valid_head is %d ,deq_num is %d,current_len is %d,total_len is %d\n",
-									__LINE__,valid_tail,valid_head,deq_num,current_len,total_len);
+									fprintf(stderr," line %d ,valid_tail is %d, valid_head is %d ,deq_num is %d,current_len is %d,void_owed is %f\n",
+									__LINE__,valid_tail,valid_head,deq_num,current_len,void_owed);
 								#endif
-								if(deq_num==0) {
-									fprintf(stderr,"%s %d deq fail ,current_rate is%f,rate_ratio is %f,valid_tail-valid_head is %d,deq_default is %d,i is %d, available is %d,ring count is %d\n"
-										,__func__,__LINE__,current_rate,rate_ratio,valid_tail-valid_head,deq_default,i,available,rte_ring_count(c2s_send_queue));
-									deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,&valid_array[i],available,NULL);
-									if(deq_num==0) {
-										fprintf(stderr,"%s %d deq fail , available is %d,ring count is %d\n",__func__,__LINE__,available,rte_ring_count(c2s_send_queue));
-										exit(-1);
-									}
-									valid_tail=valid_tail-valid_head+available;
+								if(deq_num==0) {//valid_array full, just send
+									valid_tail=valid_tail-valid_head;
 									valid_head=0;
 									nb_tx=valid_tail-valid_head;
-									#ifdef DEBUG
-									fprintf(stderr,"deq_num is %d\n",deq_num);
-									fprintf(stderr," line %d ,valid_tail is  %d ,valid_head  is  %d ,nb_tx  is  %d ,available is %d,ringcount is %d\n",
-										__LINE__,valid_tail,valid_head,nb_tx,available,rte_ring_count(c2s_send_queue));
-									#endif
 									n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&valid_array[valid_head],nb_tx);
 									while(n<nb_tx){
 										tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&valid_array[valid_head+n],nb_tx-n);
@@ -1386,62 +1444,43 @@ int c2s_rate_control_send_main_loop(){
 							}//r -l 1-9 -n 2  -- -P -p 0x3 --config="(0,0,1),(1,0,2)"
 						}
 
-						//compute void pkt number
-						void_num=total_len/2044;
-						last_void_pkt_len=total_len%2044;
-						supply_counter=0;
-						while(last_void_pkt_len<60){
-							supply_counter++;
-							last_void_pkt_len+=void_num*supply_size;
-						}
-						if(last_void_pkt_len>2044){
-							supply_counter--;
-							last_void_pkt_len=60;
-						}
-						#ifdef DEBUG
-						fprintf(stderr,"line %d before get_void_pkts,pkt first len is %d,void num is %d ,last len is %d,supply_counteris %d\n",
-						__LINE__,2044-(supply_counter*supply_size),void_num,last_void_pkt_len,supply_counter);
-						#endif
-						//get enough void pkt
-						get_void_pkts(min(void_num,MAX_VOID_BURST_SIZE),2044-(supply_counter*supply_size));
-						get_void_pkts(1,last_void_pkt_len);
-
-						//mix void pkt
+						//mix valid pkt
 						for(i=0;i<=valid_tail-valid_head;i++){
 							send_burst[i]=valid_array[valid_head+i];
 							#ifdef DEBUG
 							fprintf(stderr,"mix valid pkt %d,pktlen is %d\n",i,send_burst[i]->pkt_len);
 							#endif
 						}
-
-						for(j=i,k=0;j<i+void_num;j++,k++){
-							send_burst[j] = void_packs[2044-(supply_counter*supply_size)][k%MAX_VOID_BURST_SIZE];
-							#ifdef DEBUG
-							fprintf(stderr,"mix void pkt %d,pktlen is %d\n",j,send_burst[j]->pkt_len);
-							#endif
+						nb_tx=i;
+						packet_sent_to_server_with_payload+=nb_tx;
+						/*
+						* the void pkts owed, in chunks of at most MAX_VOID_BURST_SIZE so the
+						* refcnt of a void pkt template stays in range, send_burst is flushed
+						* when full; a low pps slot owes far more than one burst
+						*/
+						while(void_owed>=wire_len(MIN_VOID_PKT_LEN)&&!force_quit){
+							if(nb_tx+MAX_VOID_BURST_SIZE+1>send_size){
+								c2s_tx_flush(send_burst,nb_tx);
+								nb_tx=0;
+							}
+							n=mix_void_pkts(&send_burst[nb_tx],
+								(int)RTE_MIN(void_owed,(double)MAX_VOID_BURST_SIZE*wire_len(MAX_VOID_PKT_LEN)),&void_len);
+							if(n==0)
+								break;
+							nb_tx+=n;
+							void_owed-=void_len;
 						}
-						//send
-						nb_tx=(valid_tail-valid_head+1)+(void_num+1);
-						send_burst[nb_tx-1]=void_packs[last_void_pkt_len][0];
-
-						#ifdef DEBUG
-						fprintf(stderr,"mix void last one pkt %d,pktlen is %d\n",nb_tx-1,send_burst[nb_tx-1]->pkt_len);
-						#endif
-
+						/*
+						* carry what the void pkts missed to the next group, a pkt bigger than
+						* its pps slot can not be paid back by more than one void pkt
+						*/
+						void_deficit=RTE_MAX(void_owed,(double)-wire_len(MAX_VOID_PKT_LEN));
 						#ifdef DEBUG
-						fprintf(stderr,"valid_tail-valid_head+1 is %d,valid_tail is  %d ,valid_head  is  %d ,nb_tx  is  %d ,current_len  is  %d , total_len   is  %d ,void_num+1  is  %d ,supply_counter is %d,last_void_pkt_len  is  %d \n",
-							(valid_tail-valid_head+1),valid_tail,valid_head,nb_tx,current_len,total_len,void_num+1,supply_counter,last_void_pkt_len);
-						//for(k=0;k<nb_tx;k++){
-							//fprintf(stderr,"pkt %d len is %d\n",k,send_burst[k]->pkt_len);
-						//}
-						fprintf(stderr,"before send \n");
+						fprintf(stderr,"valid_tail-valid_head+1 is %d,valid_tail is  %d ,valid_head  is  %d ,nb_tx  is  %d ,current_len  is  %d ,void_deficit is %f\n",
+							(valid_tail-valid_head+1),valid_tail,valid_head,nb_tx,current_len,void_deficit);
 						#endif
-						n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,send_burst,nb_tx);
-						while(n<nb_tx){ 
-							tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&send_burst[n],nb_tx-n);
-							n+=tmpn;
-						}
-						packet_sent_to_server_with_payload+=n-(void_num+1);
+						if(nb_tx!=0)
+							c2s_tx_flush(send_burst,nb_tx);
 						valid_head=valid_tail+1;
 						rate_ratio=current_rate;
 
@@ -1451,113 +1490,112 @@ int c2s_rate_control_send_main_loop(){
 						goto RELOOP;
 					}
 				
-					if(unlikely(rte_ring_count(c2s_send_queue)==0)){
-						continue;
-					}
 			}
 
 		}
-			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the c2s_send_queue is %d,c2s_send_queue_highpri is %d\n",
-		lcore_id,packet_sent_to_server_with_payload,rte_ring_count(c2s_send_queue),rte_ring_count(c2s_send_queue_highpri));
+			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the class queues hold %u\n",
+		lcore_id,packet_sent_to_server_with_payload,class_sched_count(&sched));
 	}
-	else if(GAP_DIST_MODE==1){
+	else if(c2s_sender==C2S_SENDER_TRAIN){
 		int deq_default=10000,supply_size=1,send_size=10000;
 		struct rte_mbuf *valid_array[deq_default];
 		struct rte_mbuf *send_burst[send_size];
 		double rate_ratio=RATE_CONTROL*1.0;//Reciprocal 
 		int deq_num=0,available=0;
-		int current_len,total_len,void_len;
+		int current_len,total_len,void_len;//wire bytes
 		double current_gap,total_gap,void_gap;
-		int void_num,last_void_pkt_len,supply_counter;
+		int void_num,last_void_pkt_len,first_void_pkt_len;
 		int valid_head,valid_tail,array_end;
 		int nb_tx,n,tmpn;
-		srand(0);
+		struct gap_slot gap;
+		uint64_t timeline=time_now();
 		unsigned lcore_id= rte_lcore_id();
-		fprintf(stderr,"lcore %d——c2s_rate_control_sender,GAP_DIST_MODE==1\n",lcore_id);
+		fprintf(stderr,"lcore %d——c2s_rate_control_sender,train sender,%s gap schedule\n",
+			lcore_id,gap_sched_ring!=NULL?"gap_gen":"local");
 
 		int i,j,k;
-		for(i=60;i<=MAX_VOID_PKT_LEN;i++){
-			make_void_packs(i,0);
+		struct rte_mbuf *void_pkt;
+		struct class_sched sched;
+		/*
+		* calibration of the trains: gaps, drawn ns and valid wire bytes of the
+		* train in send_burst, and when the last flush that waited for the wire returned
+		*/
+		struct gap_calib calib;
+		uint64_t train_ns=0,train_wire=0,flush_end=0;
+		unsigned train_gaps=0,b=0;
+		gap_calib_init(&calib,GAP_ERROR_CORRECTION);
+		class_sched_init(&sched);
+		if(gap_sched_ring==NULL){
+			init_crandom(&gap_corr,GAP_CORR);
 		}
-		
-		init_crandom(gap_corr,GAP_CORR);
 
 		while (!force_quit) {
 			if(send_state==TRUE){
-				//dequeue valid pkt
-				if(rte_ring_count(c2s_send_queue)!=0) {
-					deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,deq_default,&available);
-					if(deq_num==0) {
-						deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,available,NULL);
-					}
-					if(deq_num==0) continue;
-				}
+				//dequeue valid pkt, class 0 first, the other classes by DRR
+				deq_num=class_sched_dequeue(&sched,valid_array,C2S_SCHED_BATCH);
+				if(deq_num==0) continue;
 				
+				/*
+				* the pkts and void pkts of consecutive gaps go out as one train,
+				* the void pkts keep the byte spacing inside the train
+				*/
+				nb_tx=0;
 				valid_head=0;  valid_tail=0; array_end=deq_num;
 				for(valid_tail=valid_head,current_len=0;valid_tail<array_end;valid_tail++){
 					//get current valid pkt->len
-					current_len=valid_array[valid_tail]->pkt_len;
+					current_len=wire_len(valid_array[valid_tail]->pkt_len);
 
 					/*get random number and corresponding pkt gap*/
 
 					//int rand=gap_pool->table[rand()%gap_pool->size];//This code will cause inhomogeneity, which will be improved later @whk 2022.4.18
-					
-					int rand=get_dist_rand(GAP_MEAN,GAP_JITTER/4,gap_corr,gap_pool)-GAP_ERROR_CORRECTION;//return ns gap
 
 					//get invalid pkt of corresponding length according to the pkt gap
-					total_len = rand * 10/8;//10G device(10G = 10  bits/ns)
+					if(gap_sched_next(&gap,&timeline)<0){
+						/*quit while waiting for gap_gen, the pkts left are not sent*/
+						for(;valid_tail<array_end;valid_tail++)
+							rte_pktmbuf_free(valid_array[valid_tail]);
+						break;
+					}
+					total_len = gap_calib_bytes(&calib,gap_calib_bucket(current_len),gap.gap_ns);
 
 					void_len = total_len-current_len;
 
-					if(void_len<64){
-						send_burst[0]=valid_array[valid_tail];
-						nb_tx=1;
-						n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,send_burst,nb_tx);
-						while(n<nb_tx){ 
-							tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&send_burst[n],nb_tx-n);
-							n+=tmpn;
-						}
-						packet_sent_to_server_with_payload+=1;
+					if(void_len<wire_len(MIN_VOID_PKT_LEN))
+						void_num=-1;//no void pkt
+					else
+						void_split(void_len,&void_num,&first_void_pkt_len,&last_void_pkt_len);
+					if(nb_tx+void_num+2>send_size){
+						c2s_train_flush(&calib,send_burst,nb_tx,&flush_end,&train_ns,&train_wire,&train_gaps);
+						nb_tx=0;
 					}
-					else{
-						void_num=void_len/2044;
-						last_void_pkt_len=void_len%2044;
-						supply_counter=0;
-						while(last_void_pkt_len<60){
-							supply_counter++;
-							last_void_pkt_len+=void_num*supply_size;
+					send_burst[nb_tx++]=valid_array[valid_tail];
+					train_ns+=gap.gap_ns;
+					train_wire+=current_len;
+					train_gaps++;
+					if(void_num>=0){
+						void_pkt=get_void_pkts(void_num,first_void_pkt_len);
+						for(j=0;j<void_num;j++){
+							send_burst[nb_tx++] = void_pkt;
 						}
-						if(last_void_pkt_len>2044){
-							supply_counter--;
-							last_void_pkt_len=60;
-						}
-						get_void_pkts(min(void_num,MAX_VOID_BURST_SIZE),2044-(supply_counter*supply_size));
-						get_void_pkts(1,last_void_pkt_len);
-						send_burst[0]=valid_array[valid_tail];
-						for(j=1,k=0;j<1+void_num;j++,k++){
-							send_burst[j] = void_packs[2044-(supply_counter*supply_size)][k%MAX_VOID_BURST_SIZE];
-						}
-						nb_tx=1+(void_num+1);
-						send_burst[nb_tx-1]=void_packs[last_void_pkt_len][0];
-						n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,send_burst,nb_tx);
-						while(n<nb_tx){ 
-							tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&send_burst[n],nb_tx-n);
-							n+=tmpn;
-						}
-						packet_sent_to_server_with_payload+=n-(void_num+1);
+						send_burst[nb_tx++]=get_void_pkts(1,last_void_pkt_len);
+					}
+					packet_sent_to_server_with_payload+=1;
+					if(nb_tx>=GAP_TRAIN_SIZE){
+						c2s_train_flush(&calib,send_burst,nb_tx,&flush_end,&train_ns,&train_wire,&train_gaps);
+						nb_tx=0;
 					}
 				}//if the forloop finish , valid_tail is 100;
+				if(nb_tx!=0)
+					c2s_train_flush(&calib,send_burst,nb_tx,&flush_end,&train_ns,&train_wire,&train_gaps);
 			}
 
-			if(unlikely(rte_ring_count(c2s_send_queue)==0)){
-				continue;
-			}
 		}
-			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the ringcount is %d\n",
-		lcore_id,packet_sent_to_server_with_payload,rte_ring_count(c2s_send_queue));
+			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the class queues hold %u\n",
+		lcore_id,packet_sent_to_server_with_payload,class_sched_count(&sched));
+		gap_calib_print(&calib,"c2s train");
 	}
 	else{
-		fprintf(stderr,"func %s invalid GAP_DIST_MODE,line %d",__func__,__LINE__);
+		fprintf(stderr,"func %s invalid c2s sender %u,line %d",__func__,c2s_sender,__LINE__);
 		exit(-1);
 	}
 }
@@ -1575,43 +1613,49 @@ int c2s_rate_control_send_main_loop_compare(){
 	int void_num,last_void_pkt_len,supply_counter;
 	int valid_head,valid_tail,array_end;
 	int nb_tx,n,tmpn;
-	struct timespec now,send_time;
-	srand(0);
+	struct gap_slot gap;
+	uint64_t timeline,shift=0;
 	unsigned lcore_id= rte_lcore_id();
-	fprintf(stderr,"lcore %d——c2s_rate_control_sender,GAP_DIST_MODE==1\n",lcore_id);
+	fprintf(stderr,"lcore %d——c2s_rate_control_sender,timer sender,%s gap schedule\n",
+		lcore_id,gap_sched_ring!=NULL?"gap_gen":"local");
 
 	int i,j,k;
-	for(i=60;i<=MAX_VOID_PKT_LEN;i++){
-		make_void_packs(i,0);
+	struct class_sched sched;
+	struct gap_calib calib;
+	uint64_t departure;
+	unsigned b;
+	class_sched_init(&sched);
+
+	if(gap_sched_ring==NULL){
+		init_crandom(&gap_corr,GAP_CORR);
 	}
-		
-	init_crandom(gap_corr,GAP_CORR);
+	gap_calib_init(&calib,0);
+	c2s_gap_calib_probe(&calib);
+	gap_calib_print(&calib,"c2s probe");
+	timeline=time_now();
 
 	while (!force_quit) {
 			if(send_state==TRUE){
-				//dequeue valid pkt
-				if(rte_ring_count(c2s_send_queue)!=0) {
-					deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,deq_default,&available);
-					if(deq_num==0) {
-						deq_num=rte_ring_sc_dequeue_bulk(c2s_send_queue,valid_array,available,NULL);
-					}
-					if(deq_num==0) continue;
-				}
+				//dequeue valid pkt, class 0 first, the other classes by DRR
+				deq_num=class_sched_dequeue(&sched,valid_array,C2S_SCHED_BATCH);
+				if(deq_num==0) continue;
 				
 				valid_head=0;  valid_tail=0; array_end=deq_num;
 				for(valid_tail=valid_head,current_len=0;valid_tail<array_end;valid_tail++){
 					//get current valid pkt->len
 
-					/*get random number and corresponding pkt gap*/
-					int rand=get_dist_rand(GAP_MEAN,GAP_JITTER/4,gap_corr,gap_pool);//return ns gap
-					clock_gettime(CLOCK_MONOTONIC,&send_time);
-					timespec_add_ns(&send_time,rand);
-
-					clock_gettime(CLOCK_MONOTONIC,&now);
-
-					while(timespeccmp(&now,&send_time, < )){
-						clock_gettime(CLOCK_MONOTONIC,&now);
+					/*
+					* the gap counts from the departure of the previous pkt, not from when
+					* this loop got here, so the time spent sending does not add up.
+					*/
+					if(gap_sched_next(&gap,&timeline)<0){
+						/*quit while waiting for gap_gen, the pkts left are not sent*/
+						for(;valid_tail<array_end;valid_tail++)
+							rte_pktmbuf_free(valid_array[valid_tail]);
+						break;
 					}
+					b=gap_calib_bucket(wire_len(valid_array[valid_tail]->pkt_len));
+					departure=gap_wait(&gap,&shift,gap_calib_bias(&calib,b));
 					send_burst[0]=valid_array[valid_tail];
 					nb_tx=1;
 					n = rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,send_burst,nb_tx);
@@ -1619,16 +1663,199 @@ int c2s_rate_control_send_main_loop_compare(){
 						tmpn=rte_eth_tx_burst(PORT_TO_SERVER, QUEUE_TO_CLIENT_WITH_PAYLOAD,&send_burst[n],nb_tx-n);
 						n+=tmpn;
 					}
+					/*a late pkt says nothing about the bias*/
+					if(departure!=0)
+						gap_calib_update(&calib,b,gap_calib_diff_ns(time_now(),departure));
 					packet_sent_to_server_with_payload+=1;
 				}//if the forloop finish , valid_tail is 100;
 			}
 
-			if(unlikely(rte_ring_count(c2s_send_queue)==0)){
+		}
+			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the class queues hold %u\n",
+		lcore_id,packet_sent_to_server_with_payload,class_sched_count(&sched));
+		gap_calib_print(&calib,"c2s");
+}
+
+/*
+* C2S sender of a mahimahi link trace (--mm-trace): queued pkts only leave at
+* the delivery opportunities of the trace, each one delivers up to
+* MM_OPPORTUNITY_BYTES. the pkts of one ms go out back to back at line rate and,
+* while pkts wait, void pkts fill the rest of the ms, so the next ms starts on
+* time on the wire. opportunities no pkt waits for are lost, like in mahimahi
+*/
+#define MM_TX_BURST_SIZE 4096
+
+/*put void pkts of void_len wire bytes after the nb_tx pkts of send_burst*/
+static inline int
+c2s_mm_fill(struct rte_mbuf **send_burst,int nb_tx,int void_len)
+{
+	int filled_len;
+
+	while(void_len>=wire_len(MIN_VOID_PKT_LEN)){
+		if(nb_tx+MAX_VOID_BURST_SIZE+1>MM_TX_BURST_SIZE){
+			c2s_tx_flush(send_burst,nb_tx);
+			nb_tx=0;
+		}
+		nb_tx+=mix_void_pkts(&send_burst[nb_tx],void_len,&filled_len);
+		void_len-=filled_len;
+	}
+	return nb_tx;
+}
+
+int c2s_mm_trace_send_main_loop(){
+	struct rte_mbuf *send_burst[MM_TX_BURST_SIZE];
+	struct rte_mbuf *head=NULL;//next pkt, waits for enough opportunity bytes
+	struct class_sched sched;
+	const uint64_t ms_tsc=ms_to_tsc(1);
+	const int slot_len=ns_to_wire_bytes(1000000);//wire bytes of one ms
+	uint64_t start,ms=0,now;
+	uint64_t credit=0,opp_used=0,opp_lost=0;
+	unsigned opp,lcore_id=rte_lcore_id();
+	int nb_tx,sent_len;
+
+	fprintf(stderr,"lcore %d——c2s_mm_trace_sender,period %u ms\n",lcore_id,mm_trace->period);
+	class_sched_init(&sched);
+	start=time_now();
+	while(!force_quit){
+		/*wait for ms, after an idle time go on with the ms of now*/
+		now=time_now();
+		if(now<start+ms*ms_tsc)
+			time_wait_until(start+ms*ms_tsc);
+		else if(now-start>=(ms+1)*ms_tsc)
+			ms=(now-start)/ms_tsc;
+		opp=mm_trace_opportunities(mm_trace,ms++);
+		if(send_state!=TRUE)
+			continue;
+
+		if(head==NULL && class_sched_dequeue(&sched,&head,1)==0){
+			head=NULL;
+			credit=0;
+			opp_lost+=opp;
+			continue;
+		}
+		credit+=(uint64_t)opp*MM_OPPORTUNITY_BYTES;
+		opp_used+=opp;
+		nb_tx=0;
+		sent_len=0;
+		while(head!=NULL && head->pkt_len<=credit){
+			credit-=head->pkt_len;
+			sent_len+=wire_len(head->pkt_len);
+			if(nb_tx==MM_TX_BURST_SIZE){
+				c2s_tx_flush(send_burst,nb_tx);
+				nb_tx=0;
+			}
+			send_burst[nb_tx++]=head;
+			packet_sent_to_server_with_payload+=1;
+			if(class_sched_dequeue(&sched,&head,1)==0)
+				head=NULL;
+		}
+		/*the bytes of an opportunity the queue can not use are lost*/
+		if(head==NULL)
+			credit=0;
+		else
+			nb_tx=c2s_mm_fill(send_burst,nb_tx,slot_len-sent_len);
+		if(nb_tx!=0)
+			c2s_tx_flush(send_burst,nb_tx);
+	}
+	if(head!=NULL)
+		rte_pktmbuf_free(head);
+	fprintf(stderr,"lcore %d——c2s_mm_trace_sender:packet_sent_to_server_with_payload num is %llu,opportunities used %llu,lost %llu,now the class queues hold %u\n",
+		lcore_id,packet_sent_to_server_with_payload,opp_used,opp_lost,class_sched_count(&sched));
+	return 0;
+}
+
+/* C2S run-to-completion, rx + filter + rate controlled tx on one lcore */
+/*
+* put one valid pkt and the void pkts it is owed into send_burst,
+* void bytes not sent yet (less than a min void pkt) are kept in *pending_len
+*/
+static inline int
+c2s_rtc_pace(struct rte_mbuf **send_burst,int nb_tx,struct rte_mbuf *m,double rate,double *pending_len)
+{
+	int void_len,filled_len;
+
+	if(nb_tx+MAX_VOID_BURST_SIZE+2>RTC_TX_BURST_SIZE){
+		c2s_tx_flush(send_burst,nb_tx);
+		nb_tx=0;
+	}
+	send_burst[nb_tx++]=m;
+	packet_sent_to_server_with_payload+=1;
+	if(rate>=100)
+		return nb_tx;
+
+	/*owed filler bytes stay a double, the fraction of every pkt adds up*/
+	*pending_len+=wire_len(m->pkt_len)*100.0/rate-wire_len(m->pkt_len);
+	void_len=(int)RTE_MIN(*pending_len,(double)MAX_VOID_BURST_SIZE*MAX_VOID_PKT_LEN);
+	nb_tx+=mix_void_pkts(&send_burst[nb_tx],void_len,&filled_len);
+	*pending_len-=filled_len;
+	return nb_tx;
+}
+
+int c2s_rtc_main_loop(){
+	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
+	struct rte_mbuf *send_burst[RTC_TX_BURST_SIZE];
+	struct class_sched sched;
+	unsigned lcore_id;
+	int i, j, nb_rx, deq_num, nb_tx=0, target;
+	uint64_t rtc_to_impair_num=0, rtc_impair_fail_num=0;
+	double rate, pending_len=0;
+	uint16_t portid;
+	uint8_t queueid;
+	struct lcore_conf *qconf;
+
+	lcore_id = rte_lcore_id();
+	qconf = &lcore_conf[lcore_id];
+	packet_received_from_client=0;
+	fprintf(stderr,"lcore %d——c2s_rtc\n",lcore_id);
+	class_sched_init(&sched);
+
+	while (!force_quit) {
+		rate=current_rate>0.00001?current_rate:RATE_CONTROL*1.0;
+		if(rate>100)
+			rate=100;
+		else if(rate<RTC_MIN_RATE)
+			rate=RTC_MIN_RATE;
+
+		/*send classes, delay and reorder output first, they are already late*/
+		deq_num=class_sched_dequeue(&sched,pkts_burst,MAX_PKT_BURST);
+		for(j=0;j<deq_num;j++)
+			nb_tx=c2s_rtc_pace(send_burst,nb_tx,pkts_burst[j],rate,&pending_len);
+
+		for (i = 0; i < qconf->n_rx_queue; ++i) {
+			portid = qconf->rx_queue_list[i].port_id;
+			queueid = qconf->rx_queue_list[i].queue_id;
+			nb_rx = rte_eth_rx_burst(portid, queueid, pkts_burst,
+				MAX_PKT_BURST);
+			if (nb_rx == 0)
 				continue;
+			packet_received_from_client+=nb_rx;
+			pkt_meta_rx(pkts_burst,nb_rx);
+			for(j=0;j<nb_rx;j++){
+				target=c2s_classify(pkts_burst[j],lrand());
+				/*delay and reorder send it back to the class ring of its class*/
+				pkt_meta(pkts_burst[j])->cls=c2s_pkt_class(pkts_burst[j]);
+				if(target==C2S_TO_SEND){
+					nb_tx=c2s_rtc_pace(send_burst,nb_tx,pkts_burst[j],rate,&pending_len);
+					continue;
+				}
+				pkt_meta(pkts_burst[j])->impair=target;
+				if(unlikely(c2s_impair_enqueue(pkts_burst[j],target)!=0)){
+					rte_pktmbuf_free(pkts_burst[j]);
+					rtc_impair_fail_num++;
+					continue;
+				}
+				rtc_to_impair_num++;
 			}
 		}
-			fprintf(stderr,"lcore %d——c2s_rate_control_sender:packet_sent_to_server_with_payload num is %llu,now the ringcount is %d\n",
-		lcore_id,packet_sent_to_server_with_payload,rte_ring_count(c2s_send_queue));
+
+		if(nb_tx!=0){
+			c2s_tx_flush(send_burst,nb_tx);
+			nb_tx=0;
+		}
+	}
+	fprintf(stderr,"lcore %d——c2s_rtc:packet_received_from_client num is %llu,packet_sent_to_server_with_payload num is %llu,to impair queues %llu,impair enq fail %llu\n",
+		lcore_id,packet_received_from_client,packet_sent_to_server_with_payload,rtc_to_impair_num,rtc_impair_fail_num);
+	return 0;
 }
 
 /*S2C mean Server to Client direction */
@@ -1641,16 +1868,18 @@ int s2c_receive_main_loop(){
 	uint16_t portid;
 	uint8_t queueid;
 	struct lcore_conf *qconf;
-	int test;
+	struct stage st;
 
 	lcore_id = rte_lcore_id();
-	packet_received_from_server=0;
+	stage_init(&st,"s2c_rx");
+	stage_add_output(&st,s2c_receive_queue);
 
 	qconf = &lcore_conf[lcore_id];
 	fprintf(stderr,"lcore %d——s2c_receiveer\n",lcore_id);
 
 	if (qconf->n_rx_queue == 0) {//?
 		RTE_LOG(INFO, l2shaping, "lcore %u has nothing to do\n", lcore_id);
+		lcore_stage[lcore_id]=NULL;
 		return 0;
 	}
 	RTE_LOG(INFO, l2shaping, "entering main loop on lcore %u\n", lcore_id);
@@ -1668,7 +1897,7 @@ int s2c_receive_main_loop(){
 		for (i = 0; i < qconf->n_rx_queue; ++i) {
 			portid = qconf->rx_queue_list[i].port_id;
 			queueid = qconf->rx_queue_list[i].queue_id;
-			nb_rx = rte_eth_rx_burst(PORT_TO_SERVER, queueid, pkts_burst,
+			nb_rx = rte_eth_rx_burst(portid, queueid, pkts_burst,
 				MAX_PKT_BURST);		
 			if (nb_rx == 0)
 				continue;
@@ -1698,14 +1927,13 @@ int s2c_receive_main_loop(){
      		}
 		#endif
             /*put packet in ring*/
-            enq_num=rte_ring_mp_enqueue_bulk(s2c_receive_queue, pkts_burst,nb_rx,NULL);
-			if(enq_num==0)	
-				fprintf(stderr,"[%s] enq s2c_receive_queue fail,enq_num is %llu,nb_rx is %d,[%d]\n",__func__, enq_num,nb_rx, __LINE__);
-			packet_received_from_server+=enq_num;
+            enq_num=rx_admit(&st,s2c_receive_queue,pkts_burst,nb_rx);
+			__atomic_fetch_add(&packet_received_from_server,enq_num,__ATOMIC_RELAXED);
 		}
 	}
-	fprintf(stderr,"lcore %d——s2c_receiveer:packet_received_from_server num is %llu\n",
-		lcore_id,packet_received_from_server);
+	fprintf(stderr,"lcore %d——s2c_receiveer:packet_received_from_server num is %llu,overload drop %llu\n",
+		lcore_id,packet_received_from_server,st.stats.drop);
+	lcore_stage[lcore_id]=NULL;
 
 	return 0;
 }
@@ -1713,87 +1941,56 @@ int s2c_receive_main_loop(){
 /*S2C sender*/
 int s2c_send_main_loop(){
     struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-	int nb_tx,i,n,enq_num,deq_num,fail_num,available=0;
+	int nb_tx,i,n,fail_num;
 	unsigned lcore_id;
-    unsigned int count;
 
 	packet_sent_to_client_with_payload=0;
 	fail_num=0;
 	lcore_id = rte_lcore_id();
 	fprintf(stderr,"lcore %d——s2c_sender\n",lcore_id);
-    count = 0;
 
     while (!force_quit) {
-		count =  rte_ring_count(s2c_send_queue);
-		if(likely(count !=0)) {
-			nb_tx=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_tx;
-			deq_num=rte_ring_sc_dequeue_bulk(s2c_send_queue,pkts_burst,nb_tx,&available);
-			if(deq_num==0) {
-				deq_num=rte_ring_sc_dequeue_bulk(s2c_send_queue,pkts_burst,available,NULL);
-			}
-			if(deq_num==0) continue;
-			n = rte_eth_tx_burst(PORT_TO_CLIENT, QUEUE_TO_CLIENT_WITH_PAYLOAD, pkts_burst, nb_tx);
-			packet_sent_to_client_with_payload+=n;
-			if (unlikely(n < nb_tx)) {
-				enq_num=rte_ring_mp_enqueue_bulk(s2c_send_queue, &pkts_burst[n],nb_tx-n,NULL);
-				fail_num+=enq_num;
-				if(unlikely(enq_num!=nb_tx-n))	{
-					rte_exit(EXIT_FAILURE, "[%s] enq s2c_send_queue fail,[%d]\n",__func__,  __LINE__);
-				}
-			}
-        }
+		nb_tx=rte_ring_sc_dequeue_burst(s2c_send_queue,(void **)pkts_burst,MAX_PKT_BURST,NULL);
+		if(nb_tx==0) continue;
+		/*a busy nic holds the sender, s2c_send_queue fills up and the filter stops*/
+		n = rte_eth_tx_burst(PORT_TO_CLIENT, QUEUE_TO_CLIENT_WITH_PAYLOAD, pkts_burst, nb_tx);
+		while (unlikely(n < nb_tx) && !force_quit) {
+			fail_num++;
+			n += rte_eth_tx_burst(PORT_TO_CLIENT, QUEUE_TO_CLIENT_WITH_PAYLOAD, &pkts_burst[n], nb_tx-n);
+		}
+		packet_sent_to_client_with_payload+=n;
+		for(i=n;i<nb_tx;i++)
+			rte_pktmbuf_free(pkts_burst[i]);
     }
-	fprintf(stderr,"lcore %d——s2c_sender:packet_sent_to_client_with_payload  num is %llu,now the ringcount is %d,fail num is %d\n",
+	fprintf(stderr,"lcore %d——s2c_sender:packet_sent_to_client_with_payload  num is %llu,now the ringcount is %d,tx retry num is %d\n",
 		lcore_id,packet_sent_to_client_with_payload,rte_ring_count(s2c_send_queue),fail_num);
+	return 0;
 }
 
 /*S2C filter*/
 int s2c_filter_main_loop(){
-    struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-	int nb_trans,i,n,enq_num,deq_num,ret,available;
+    struct rte_mbuf *pkts_burst[STAGE_BURST_SIZE];
+	int i,deq_num;
 	unsigned lcore_id;
-    int count;
+	struct stage st;
 	
 	packet_sent_to_client_without_payload=0;
 	lcore_id = rte_lcore_id();
-    count = 0;
 	fprintf(stderr,"lcore %d——s2c_filter\n",lcore_id);
+	stage_init(&st,"s2c_filter");
+	stage_add_input(&st,s2c_receive_queue);
+	stage_add_output(&st,s2c_send_queue);
 	
     while (!force_quit) {
-		if(likely(count !=0)) {
-			nb_trans=(count>MAX_PKT_BURST)?MAX_PKT_BURST:count;
-			count-=nb_trans;
-			deq_num=rte_ring_sc_dequeue_bulk(s2c_receive_queue,pkts_burst,nb_trans,&available);
-			if(deq_num==0) {
-				deq_num=rte_ring_sc_dequeue_bulk(s2c_receive_queue,pkts_burst,available,NULL);
-			}
-			else{
-				if(pkts_burst[0]->pkt_len>=0){
-					enq_num=rte_ring_mp_enqueue_bulk(s2c_send_queue, pkts_burst,nb_trans,NULL);
-					if(unlikely(enq_num!=nb_trans))	{
-						rte_exit(EXIT_FAILURE, "s2c_filter_main_loop lcore enq c2s_send_queue fail,enq_num is %d,nb_rx is %d\n",enq_num,nb_trans);
-					}
-				}
-				else{
-					n = rte_eth_tx_burst(PORT_TO_CLIENT, QUEUE_TO_CLIENT_WITHOUT_PAYLOAD, pkts_burst, nb_trans);
-					//fprintf(stderr,"lcore %d in trans_main_loop，send success!!!!!\n",lcore_id);
-					packet_sent_to_client_without_payload+=n;
-					if (unlikely(n < nb_trans)) {
-						enq_num=rte_ring_mp_enqueue_bulk(s2c_receive_queue, &pkts_burst[n],nb_trans-n,NULL);
-						if(unlikely(enq_num!=nb_trans-n))	{
-							rte_exit(EXIT_FAILURE, "s2c_filter_main_loop lcore enq c2s_send_queue fail,enq_num is %d,nb_rx is %d\n",enq_num,nb_trans-n);
-						}
-					}
-				}
-			}
-        }
-		else{
-			count =  rte_ring_count(s2c_receive_queue);
-		}
+		deq_num=stage_poll(&st,pkts_burst,STAGE_BURST_SIZE);
+		for(i=0;i<deq_num;i++)
+			stage_emit(&st,0,pkts_burst[i]);
+		stage_flush(&st);
     }
-	fprintf(stderr,"lcore %d——s2c_filter:packet_sent_to_server_without_payload num is %llu,now the s2c_receive_queue count is %d\n",
-		lcore_id,packet_sent_to_client_without_payload,rte_ring_count(s2c_receive_queue));
+	fprintf(stderr,"lcore %d——s2c_filter:to s2c_send_queue %llu,ring full drop %llu,now the s2c_receive_queue count is %d\n",
+		lcore_id,st.stats.tx,st.stats.drop,rte_ring_count(s2c_receive_queue));
+	lcore_stage[lcore_id]=NULL;
+	return 0;
 }
 
 void
@@ -2239,39 +2436,77 @@ int init_ipv4_void_traffic(struct rte_mempool *mp,
 int temp_debug_flag1=0;
 int temp_debug_prop=0;//proportion of temp_debug_flag1 and
 
-/*if flag==1,log the function call*/
-void make_void_packs(uint32_t packet_size,int flag)
+/*build the filler template of packet_size, called once per size before the lcores start*/
+void make_void_packs(uint32_t packet_size)
 {
-	if(flag==1){
-		fprintf(stderr,"rate_control_lool want make void pack again! size is %lu err!!",packet_size);
-	}
     int ret=0; 
-    ret=init_ipv4_void_traffic(produce_packs_pool,void_packs[packet_size],MAX_VOID_BURST_SIZE,packet_size);
-    if(ret==-1){
+    ret=init_ipv4_void_traffic(void_pack_pool,&void_pkt_tmpl[packet_size],1,packet_size);
+    if(ret!=1){
         fprintf(stderr,"make_void_packs err, init_ipv4_void_traffic fail!\n");
         exit(-1);
     }
 }
 
-void get_void_pkts(uint32_t burst_size,uint32_t packet_size)
+/*
+* return the filler template of packet_size with burst_size more references,
+* put it burst_size times into the tx burst, every tx completion (or free) drops one.
+* the template itself keeps the first reference so it is never freed
+*/
+struct rte_mbuf *get_void_pkts(uint32_t burst_size,uint32_t packet_size)
 {
-    int i;
-    if(burst_size>MAX_VOID_BURST_SIZE ||burst_size<0){
-        fprintf(stderr,"get_void_pkts err, invalid burst_size!,burst_size is %d\n",burst_size);
-        exit(-1);
-    }
-	if(packet_size>MAX_VOID_PKT_LEN ||packet_size<0){
+	if(packet_size>MAX_VOID_PKT_LEN ||packet_size<MIN_VOID_PKT_LEN){
         fprintf(stderr,"get_void_pkts err, invalid packet_size!packet_size is %d\n",packet_size);
         exit(-1);
     }
-    if(void_packs[packet_size][0]==NULL){
-        make_void_packs(packet_size,1);//加flag看是否调用这部分函数
-		fprintf(stderr,"get_void_pkts again !!!!,exit(-1)\n");
-		exit(-1);
-    }
-    for(i=0;i<burst_size;i++){
-        void_packs[packet_size][i]->refcnt=32767;//any >1 number .
-    }
+    if(burst_size!=0)
+        rte_mbuf_refcnt_update(void_pkt_tmpl[packet_size],burst_size);
+    return void_pkt_tmpl[packet_size];
+}
+
+/*
+* split void_len wire bytes (at least wire_len(MIN_VOID_PKT_LEN)) into void_num void pkts
+* of first_len and one of last_len, every void pkt pays WIRE_OVERHEAD on the wire.
+* the first ones give a byte each until the last one is at least MIN_VOID_PKT_LEN
+*/
+void void_split(int void_len,int *void_num,int *first_len,int *last_len)
+{
+	int num,last,supply_counter=0;
+
+	num=void_len/wire_len(MAX_VOID_PKT_LEN);
+	last=void_len-num*wire_len(MAX_VOID_PKT_LEN)-WIRE_OVERHEAD;
+	while(last<MIN_VOID_PKT_LEN){
+		supply_counter++;
+		last+=num;
+	}
+	if(last>MAX_VOID_PKT_LEN){
+		supply_counter--;
+		last=MIN_VOID_PKT_LEN;
+	}
+	*void_num=num;
+	*first_len=MAX_VOID_PKT_LEN-supply_counter;
+	*last_len=last;
+}
+
+/*
+* put void pkts of about void_len wire bytes into send_burst, the same way the rate control sender does,
+* return the number of void pkts, *filled_len is the wire bytes really put in
+*/
+int mix_void_pkts(struct rte_mbuf **send_burst,int void_len,int *filled_len)
+{
+	int void_num,last_void_pkt_len,first_len,k;
+	struct rte_mbuf *void_pkt;
+
+	*filled_len=0;
+	if(void_len<wire_len(MIN_VOID_PKT_LEN))
+		return 0;
+	void_len=min(void_len,MAX_VOID_BURST_SIZE*wire_len(MAX_VOID_PKT_LEN));
+	void_split(void_len,&void_num,&first_len,&last_void_pkt_len);
+	void_pkt=get_void_pkts(void_num,first_len);
+	for(k=0;k<void_num;k++)
+		send_burst[k]=void_pkt;
+	send_burst[void_num]=get_void_pkts(1,last_void_pkt_len);
+	*filled_len=void_num*wire_len(first_len)+wire_len(last_void_pkt_len);
+	return void_num+1;
 }
 
 /*计算因400ns导致的速率损失是否会造成实际上的速率*/
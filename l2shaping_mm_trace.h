@@ -0,0 +1,89 @@
+#ifndef _L2SHAPING_MM_TRACE_H_
+#define _L2SHAPING_MM_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* mahimahi link trace: one line per delivery opportunity, the line is the ms
+* (from the start) the opportunity comes at, the same ms may be given several
+* times. every opportunity may deliver MM_OPPORTUNITY_BYTES of queued pkts.
+* the trace repeats with the period of its last line.
+* it is kept as the number of opportunities of every ms of the period.
+*/
+
+#define MM_OPPORTUNITY_BYTES 1500
+#define MM_TRACE_MAX_MS (24 * 3600 * 1000)
+
+struct mm_trace {
+	uint32_t period;		//ms
+	uint64_t nb_opportunities;
+	uint16_t opp[];			//opportunities of every ms
+};
+
+/*NULL without --mm-trace, c2s_tx then paces by the rate control*/
+struct mm_trace *mm_trace;
+
+/*read a trace file, exit on a bad one like parse_dist_table*/
+static inline struct mm_trace *
+mm_trace_load(const char *path)
+{
+	struct mm_trace *t;
+	FILE *file;
+	char buf[64], *end;
+	unsigned long ms, last = 0;
+	uint32_t line = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "mm trace %s open fail!\n", path);
+		exit(-1);
+	}
+	/*the last line is the period*/
+	while (fgets(buf, sizeof(buf), file)) {
+		line++;
+		if (buf[0] == '\n' || buf[0] == '\r' || buf[0] == '#')
+			continue;
+		ms = strtoul(buf, &end, 10);
+		if (end == buf || ms < last || ms > MM_TRACE_MAX_MS) {
+			fprintf(stderr, "mm trace %s: bad opportunity at line %u\n", path, line);
+			exit(-1);
+		}
+		last = ms;
+	}
+	if (last == 0) {
+		fprintf(stderr, "mm trace %s: the last opportunity must be after 0 ms\n", path);
+		exit(-1);
+	}
+	t = calloc(1, sizeof(*t) + last * sizeof(uint16_t));
+	if (t == NULL) {
+		fprintf(stderr, "mm trace malloc fail!\n");
+		exit(-1);
+	}
+	t->period = last;
+	fseek(file, 0L, SEEK_SET);
+	while (fgets(buf, sizeof(buf), file)) {
+		if (buf[0] == '\n' || buf[0] == '\r' || buf[0] == '#')
+			continue;
+		ms = strtoul(buf, NULL, 10);
+		if (t->opp[ms % last] != UINT16_MAX)
+			t->opp[ms % last]++;
+		t->nb_opportunities++;
+	}
+	fclose(file);
+	fprintf(stderr, "mm trace %s: %lu opportunities in %u ms, %.2f Mbps\n",
+		path, t->nb_opportunities, t->period,
+		t->nb_opportunities * MM_OPPORTUNITY_BYTES * 8.0 / t->period / 1000);
+	return t;
+}
+
+/*opportunities at ms from the start of the trace*/
+static inline unsigned
+mm_trace_opportunities(const struct mm_trace *t, uint64_t ms)
+{
+	return t->opp[ms % t->period];
+}
+
+#endif
@@ -8,7 +8,7 @@
 
 //#define DEBUG
 //#define DIST_MODE //开启后速率实时变化
-#define GAP_DIST_MODE 1 //0: linerate control,1 : pkt gap dist control
+#define GAP_DIST_MODE 1 //0: linerate control,1 : pkt gap dist control, picks the default c2s sender
 
 //model file control
 #define DIST_FLAG 2 	//1 is shaping dist model,2 is gap dist model, 3 is delay dist model
@@ -19,13 +19,18 @@
 #define GAP_MEAN   100000  //unit: nanosecond
 #define GAP_CORR 25
 //#define GAP_ERROR_CORRECTION 0//unit: nanosecond
-#define GAP_ERROR_CORRECTION 1200//unit: nanosecond
+#define GAP_ERROR_CORRECTION 1200//unit: nanosecond, first gap bias of the void pkt train sender, l2shaping_gap_calib.h corrects it online
+#define GAP_TRAIN_SIZE 512	//the train sender sends the pkts and void pkts of many gaps in one tx burst of about this many
 
 #define DELAY_MODE_OPEN 0  //0: close, 1 : open
 #define DELAY_JITTER  0  //unit: nanosecond
 #define DELAY_MEAN   50000000  //unit: nanosecond 
-#define DELAY_PREC		1	   //unit: nanosecond
-#define DELAY_IP_MASK 20   //32~20,determine the range of disttable
+#define DELAY_CORR 0		//correlation of successive pkt delays in percent, set by --delay-corr
+#define DELAY_LINE_RATE_MBPS 10000	//rate the delay lcores hold for the longest delay, set by --delay-line-rate
+#define DELAY_LINE_PKT_LEN 512		//mean pkt len the mbuf pool is grown for to hold that
+#define DELAY_ARENA_BUCKET_SHIFT 18	//delay arena release granularity, 2^18 tsc cycles, about 0.1ms
+#define DELAY_KEEP_ORDER 0	//0: jitter may reorder a flow, 1: a pkt never leaves before the one ahead of it in its flow, set by --delay-order
+#define TIMER_WHEEL_TICK_SHIFT 10	//delay timer wheel tick is 2^10 tsc cycles, about 0.4us
 
 //#define DELAY_IP_MIN IPV4_ADDR(192, 168, 100, 1)
 //#define DELAY_IP_MAX IPV4_ADDR(192, 168, 116,0 )
@@ -37,26 +42,23 @@
 //#define REORDER_IP_MAX IPV4_ADDR(192, 168, 116,0 )
 #define REORDER_IP_MIN IPV4_ADDR(192, 168, 131, 99)
 #define REORDER_IP_MAX IPV4_ADDR(192, 168, 131, 101)
-#define REORDER_STACK_LEVEL 2
-#define REORDER_STACK_TIMER 300000000
-#define REORDER_RATIO 0.25
-//#define TCP_CRR	
+#define REORDER_SWAP_MODE 1	//1: swap, a held pkt is passed by REORDER_DISTANCE pkts of its flow, 0: netem gap, set by --reorder
+#define REORDER_PROB 0.25	//probability a pkt is held (swap) or let through early (gap)
+#define REORDER_DISTANCE 1	//swap: pkts of the flow that pass a held one
+#define REORDER_GAP 0	//gap: held pkts between two let through early, 0: every pkt is held
+#define REORDER_HOLD_US 300000	//a held pkt goes out at the latest after this, set by --reorder-hold-us
 struct crndstate {
 	uint32_t last;
 	uint64_t rho;
 } ;
-struct crndstate * gap_corr;
+struct crndstate gap_corr;
+uint32_t delay_corr;		//DELAY_CORR unless --delay-corr
 
 struct disttable{
 	uint32_t size;
 	int64_t table[];
 };
 
-struct ts_mbuf{
-    struct rte_mbuf *mbuf;
-    struct timespec ts;
-};
-
 struct disttable *shaping_dist;
 int16_t shaping_max,shaping_min; 	//the max and min of shaping_dist->table, Used to shrink the table's value to 0~10000
 struct disttable *gap_dist;			//Probability distribution function
@@ -64,7 +66,6 @@ struct disttable * gap_dens_dist;	//Probability density function
 struct disttable * gap_pool;
 
 struct disttable *delay_dist;
-struct disttable *delay_pool;
 
 #define BOOL int
 #define TRUE 1
@@ -72,26 +73,56 @@ struct disttable *delay_pool;
 
 volatile BOOL send_state;
 volatile BOOL timing;
+BOOL rx_shared_ring;	//all c2s_rx lcores feed c2s_receive_queue, set by --rx-shared-ring
+BOOL delay_keep_order;	//DELAY_KEEP_ORDER unless --delay-order
+
+/*what rx does with a burst its ring can not take, set by --overload-policy*/
+enum overload_policy {
+	OVERLOAD_TAILDROP = 0,		//drop the tail of the burst
+	OVERLOAD_KEEP_HIGHPRI,		//enqueue the high priority pkts first, drop low priority ones
+};
+int overload_policy;
 
 #define IPV4_ADDR(a, b, c, d)(((a & 0xff) << 24) | ((b & 0xff) << 16) | \
 		((c & 0xff) << 8) | (d & 0xff))
 
 //lcore control
-#define RECEIVE_LCORE_NUM 4  
+#define RECEIVE_LCORE_NUM 4
 #define START_LCORE 6
 
-#define IS_RECEIVE_LCORE_FOR_CLIENT rte_lcore_id()==1    
-#define IS_RECEIVE_LCORE_FOR_SERVER rte_lcore_id()==2 
-#define IS_POLICY_LCORE     		rte_lcore_id()==3 
-#define IS_SEND_LCORE_TO_SERVER  	rte_lcore_id()==4
-#define IS_SEND_LCORE_TO_CLIENT  	rte_lcore_id()==5
-#define IS_TRANS_TO_SERVER 			rte_lcore_id()==6
-#define IS_TRANS_TO_CLIENT 			rte_lcore_id()==7
-#define IS_PRINT_LCORE 				rte_lcore_id()==8
-#define IS_DROP_LCORE 				rte_lcore_id()==9
-#define IS_DELAY_LCORE 				rte_lcore_id()==10
-#define IS_REORDER_LCORE 			rte_lcore_id()==11
-#define IS_REFRAME_LCORE 			rte_lcore_id()==12
+/*
+* pipeline stage run by an lcore, set by --lcore-role.
+* without --lcore-role the old fixed numbering is used:
+* 1 c2s_rx, 2 s2c_rx, 3 policy, 4 c2s_tx, 5 s2c_tx, 6 c2s_filter,
+* 7 s2c_filter, 8 print, 9 drop, 10 delay, 11 reorder
+* c2s_rtc replaces c2s_rx, c2s_filter and c2s_tx with one run-to-completion lcore
+* gap_gen precomputes the pkt gaps of c2s_tx
+*/
+enum lcore_role {
+	LCORE_ROLE_NONE = 0,
+	LCORE_ROLE_C2S_RX,
+	LCORE_ROLE_S2C_RX,
+	LCORE_ROLE_POLICY,
+	LCORE_ROLE_C2S_TX,
+	LCORE_ROLE_S2C_TX,
+	LCORE_ROLE_C2S_FILTER,
+	LCORE_ROLE_S2C_FILTER,
+	LCORE_ROLE_PRINT,
+	LCORE_ROLE_DROP,
+	LCORE_ROLE_DELAY,
+	LCORE_ROLE_REORDER,
+	LCORE_ROLE_DUMP,
+	LCORE_ROLE_C2S_RTC,
+	LCORE_ROLE_GAP_GEN,
+	LCORE_ROLE_MAX
+};
+
+/*max lcores sharing one role, only filter, delay and reorder may have more than one*/
+#define MAX_STAGE_INSTANCES 16
+
+/*run-to-completion lcore: max pkts (valid + void) of one tx burst, min rate it can pace*/
+#define RTC_TX_BURST_SIZE 4096
+#define RTC_MIN_RATE 1
 
 
 
@@ -99,14 +130,33 @@ volatile BOOL timing;
 #define BUFFER_TIME 100
 #define BUFFER_PKT_SIZE 0
 
-/*c2s send speed control ratio , e.g. 50 mean 10G *50%*/
+/*c2s send speed control ratio , e.g. 50 mean link speed *50%*/
 #define RATE_CONTROL 30
+/*speed of the c2s tx port from rte_eth_link_get, the rate and gap maths use it*/
+#define DEFAULT_LINK_SPEED_MBPS 10000
+uint32_t link_speed_mbps;
+/*the rate sender paces to rate_pps pkts per second instead of the ratio when not 0, set by --rate-pps*/
+uint64_t rate_pps;
+
+/*
+* sender of the c2s_tx lcore, set by --c2s-sender:
+* timer: one pkt per tx burst at the drawn gap, waits on the tsc (GAP_DIST_MODE 1 default)
+* train: drawn gaps as void pkts, many gaps per tx burst
+* rate: void pkts to RATE_CONTROL/current_rate or rate_pps (GAP_DIST_MODE 0 default)
+*/
+#define C2S_SENDER_TIMER 0
+#define C2S_SENDER_TRAIN 1
+#define C2S_SENDER_RATE 2
+uint8_t c2s_sender;
 #define DROP_RATIO 0
 
 struct rte_mempool *produce_packs_pool;
+#define PRODUCE_PACKS_POOL_SIZE 8191
+#define MIN_VOID_PKT_LEN 60
 #define MAX_VOID_PKT_LEN 2044
 #define MAX_VOID_BURST_SIZE 1000
-struct rte_mbuf* void_packs[MAX_VOID_PKT_LEN+1][MAX_VOID_BURST_SIZE];
+/*one filler template per size, sent many times at once by taking more references*/
+struct rte_mbuf *void_pkt_tmpl[MAX_VOID_PKT_LEN+1];
 
 //information of receive burst 
 #define BURST_GAP_IN 15 
@@ -124,19 +174,54 @@ struct rte_ring *c2s_reframe_queue1;
 struct rte_ring *c2s_reframe_queue2;
 struct rte_ring *c2s_reframe_queue3;
 struct rte_ring *c2s_send_queue;
-struct rte_ring *c2s_send_queue_highpri;//put the pkt from delay_worker
-struct rte_ring *c2s_receive_queue;
+struct rte_ring *c2s_send_queue_highpri;//strict class, sent before the others
+
+/*c2s send classes, the paced sender serves them by l2shaping_class_sched.h*/
+#define C2S_MAX_CLASSES 8
+#define C2S_CLASS_STRICT 0	//strict priority, --class-map can not name it
+#define C2S_CLASS_DEFAULT 1	//pkts --class-map does not name
+#define C2S_CLASS_QUANTUM 3072	//default DRR quantum, wire bytes
+#define C2S_SCHED_BATCH 64	//pkts the gap senders take from the scheduler at once
+#define C2S_CLASS_BURST 32768	//token bucket depth of the class rate and ceil, wire bytes
+#define C2S_MAX_CLASS_PREFIX 32
+enum c2s_class_by {
+	CLASS_BY_MARKER,	//payload byte pri_check reads, 0 or 1
+	CLASS_BY_DSCP,
+	CLASS_BY_PCP,
+	CLASS_BY_VLAN,		//vlan id
+	CLASS_BY_DST,		//server ip prefix, --class-prefix
+};
+struct c2s_class_prefix {
+	uint32_t addr;		//host order
+	uint32_t mask;
+	uint8_t cls;
+};
+struct rte_ring *c2s_class_queue[C2S_MAX_CLASSES];//[0] is c2s_send_queue_highpri, [1] is c2s_send_queue
+uint16_t c2s_nb_classes;
+int c2s_class_by;							//set by --class-by
+uint8_t c2s_class_map[4096];				//marker, dscp, pcp or vlan id to class, set by --class-map
+uint32_t c2s_class_quantum[C2S_MAX_CLASSES];	//set by --class-quantum
+/*
+* htb: guaranteed rate and ceiling of each class in Mbps, 0 is none, set by --class-rate.
+* the root is the paced link itself, a class over its rate borrows up to its ceil
+* what the classes under their rate leave
+*/
+uint32_t c2s_class_rate[C2S_MAX_CLASSES];
+uint32_t c2s_class_ceil[C2S_MAX_CLASSES];
+struct c2s_class_prefix c2s_class_prefix[C2S_MAX_CLASS_PREFIX];	//longest first, set by --class-prefix
+uint16_t c2s_nb_class_prefix;
+struct rte_ring *c2s_receive_queue;//shared by all c2s_rx lcores with --rx-shared-ring
+struct rte_ring *c2s_receive_shard_queue[MAX_STAGE_INSTANCES];//one per c2s_rx lcore, SP/SC
 struct rte_ring *c2s_drop_process_queue;
-struct rte_ring *c2s_delay_process_queue;
-struct rte_ring *c2s_reorder_process_queue;
+struct rte_ring *c2s_delay_process_queue[MAX_STAGE_INSTANCES];//one per delay lcore
+struct rte_ring *c2s_reorder_process_queue[MAX_STAGE_INSTANCES];//one per reorder lcore
 struct rte_ring *c2s_dump_process_queue;
 struct rte_ring *s2c_send_queue;
 struct rte_ring *s2c_receive_queue;
 
-/*void pkt rate control*/
+/*void pkt rate control, holds the filler templates*/
+#define VOID_PACK_POOL_SIZE 2047
 struct rte_mempool *void_pack_pool;
-struct rte_mbuf *template_void_pack_mbuf;
-struct rte_mbuf *send_void_pack_mbufs[32];
 
 //signal of send_state
 /*
@@ -146,7 +231,6 @@ QUEUE_TO_XXX 带payload
 QUEUE_TO_XXX +1  不带payload
 */
 
-#define DUE_TIMER_SIG SIGRTMAX
 #define PORT_TO_SERVER 0
 #define QUEUE_TO_SERVER_WITH_PAYLOAD 0  //with payload
 #define QUEUE_TO_SERVER_WITHOUT_PAYLOAD QUEUE_TO_SERVER_WITH_PAYLOAD+1
@@ -167,8 +251,6 @@ QUEUE_TO_XXX +1  不带payload
 */
 #define SEND_PACKET_GAP 1000
 
-//information of cpu,to control the send rate
-#define CPU_MHZ 1600 //1600Mhz mean ,1 cycle cost 0.000 000 000 625s = 0.625ns
 #define IP_DEFTTL 64
 
 /*
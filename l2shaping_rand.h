@@ -0,0 +1,90 @@
+#ifndef _L2SHAPING_RAND_H_
+#define _L2SHAPING_RAND_H_
+
+#include <stdint.h>
+#include <rte_lcore.h>
+
+/*
+* per lcore random numbers for the drop, gap and delay draws: xoshiro256**,
+* no lock and no shared state, unlike glibc rand(). every stage instance gets
+* its own stream from --seed, its role and its instance, so a run can be
+* replayed with the same seed whatever lcores the stages are put on.
+*/
+
+struct lrand {
+	uint64_t s[4];
+} __rte_cache_aligned;
+
+struct lrand lrand_state[RTE_MAX_LCORE];
+uint64_t lrand_seed;		//set by --seed, else from the clock
+
+static inline uint64_t
+lrand_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t
+lrand_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*stream of one stage instance*/
+static inline void
+lrand_init(struct lrand *r, uint64_t seed, unsigned role, unsigned instance)
+{
+	uint64_t x = seed ^ ((uint64_t)role << 48) ^ ((uint64_t)instance << 32);
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r->s[i] = lrand_splitmix64(&x);
+}
+
+static inline uint64_t
+lrand_next(struct lrand *r)
+{
+	uint64_t *s = r->s;
+	const uint64_t result = lrand_rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = lrand_rotl(s[3], 45);
+	return result;
+}
+
+/*n draws at once, the state stays in registers for the whole loop*/
+static inline void
+lrand_fill(struct lrand *r, uint64_t *out, unsigned n)
+{
+	struct lrand l = *r;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		out[i] = lrand_next(&l);
+	*r = l;
+}
+
+/*a draw in [0,n), by multiply and shift instead of a division*/
+static inline uint32_t
+lrand_range(uint64_t rnd, uint32_t n)
+{
+	return ((rnd >> 32) * n) >> 32;
+}
+
+/*draw of the calling lcore*/
+static inline uint64_t
+lrand(void)
+{
+	return lrand_next(&lrand_state[rte_lcore_id()]);
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef _L2SHAPING_RATE_PROFILE_H_
+#define _L2SHAPING_RATE_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "l2shaping.h"
+
+/*
+* rate profile: the policy maker replays a list of (time offset, rate) points
+* into current_rate on the tsc. between two points the rate is held, or with
+* interp moves linearly, updated every RATE_PROFILE_STEP_US. past the last
+* point the profile starts over (loop, the last point only marks the end of
+* the period), keeps the last rate (hold) or gives back RATE_CONTROL.
+*
+* trace file, one point per line, '#' starts a comment:
+*	<offset us> <rate>
+* the rate is in Mbps, or in percent of the link with a '%' suffix.
+* offsets must not go back.
+*/
+
+#define RATE_PROFILE_MAX_POINTS 65536
+#define RATE_PROFILE_STEP_US 10		//update period of an interpolated rate
+
+enum rate_profile_flag {
+	RATE_PROFILE_LOOP = 1,
+	RATE_PROFILE_INTERP = 2,
+	RATE_PROFILE_HOLD = 4,
+};
+
+struct rate_point {
+	uint64_t offset;		//tsc from the start of the profile
+	double value;
+	uint8_t pct;			//value is percent of the link, else Mbps
+	double rate;			//percent of the link, set by rate_profile_start
+};
+
+struct rate_profile {
+	uint32_t nb_points;
+	uint32_t cur;			//last point passed
+	uint32_t flags;
+	uint8_t done;
+	uint64_t start;			//tsc of offset 0
+	uint64_t next;			//tsc of the next rate update
+	uint64_t step;
+	struct rate_point points[];
+};
+
+/*NULL without --rate-trace*/
+struct rate_profile *rate_profile;
+
+static inline struct rate_profile *
+rate_profile_alloc(uint32_t nb_points, uint32_t flags)
+{
+	struct rate_profile *p;
+
+	p = calloc(1, sizeof(*p) + nb_points * sizeof(struct rate_point));
+	if (p == NULL) {
+		fprintf(stderr, "rate profile malloc fail!\n");
+		exit(-1);
+	}
+	p->nb_points = nb_points;
+	p->flags = flags;
+	return p;
+}
+
+/*read a trace file, exit on a bad one like parse_dist_table*/
+static inline struct rate_profile *
+rate_profile_load(const char *path, uint32_t flags)
+{
+	struct rate_profile *p;
+	struct rate_point *pt;
+	FILE *file;
+	char buf[256], *s, *end;
+	double us, value;
+	uint32_t n = 0, line = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "rate trace %s open fail!\n", path);
+		exit(-1);
+	}
+	p = rate_profile_alloc(RATE_PROFILE_MAX_POINTS, flags);
+	while (fgets(buf, sizeof(buf), file)) {
+		line++;
+		s = strchr(buf, '#');
+		if (s != NULL)
+			*s = '\0';
+		us = strtod(buf, &end);
+		if (end == buf) {
+			for (s = buf; *s == ' ' || *s == '\t' || *s == '\r' || *s == '\n'; s++)
+				;
+			if (*s == '\0')
+				continue;
+			goto bad;
+		}
+		s = end;
+		value = strtod(s, &end);
+		if (end == s || us < 0 || value < 0)
+			goto bad;
+		if (n == RATE_PROFILE_MAX_POINTS) {
+			fprintf(stderr, "rate trace %s: more than %d points\n",
+				path, RATE_PROFILE_MAX_POINTS);
+			exit(-1);
+		}
+		pt = &p->points[n];
+		pt->offset = (uint64_t)(us * tsc_hz / 1e6);	//ns_to_tsc overflows past a few minutes
+		pt->value = value;
+		pt->pct = *end == '%';
+		if (n != 0 && pt->offset < p->points[n - 1].offset)
+			goto bad;
+		n++;
+	}
+	fclose(file);
+	if (n == 0) {
+		fprintf(stderr, "rate trace %s has no points\n", path);
+		exit(-1);
+	}
+	p->nb_points = n;
+	fprintf(stderr, "rate trace %s: %u points, %lu us\n", path, n,
+		(uint64_t)(p->points[n - 1].offset * 1e6 / tsc_hz));
+	return p;
+bad:
+	fprintf(stderr, "rate trace %s: bad point at line %u\n", path, line);
+	exit(-1);
+}
+
+/*Mbps to percent of the link, link_speed_mbps is only known once the port is up*/
+static inline void
+rate_profile_start(struct rate_profile *p, uint64_t now)
+{
+	uint32_t i;
+
+	for (i = 0; i < p->nb_points; i++)
+		p->points[i].rate = p->points[i].pct ? p->points[i].value :
+			p->points[i].value * 100.0 / link_speed_mbps;
+	p->step = us_to_tsc(RATE_PROFILE_STEP_US);
+	p->start = now;
+	p->next = now;
+	p->cur = 0;
+	p->done = 0;
+}
+
+/*
+* rate at now, sets p->next to when it changes. the points passed are
+* skipped, so a late call does not replay them one by one
+*/
+static inline double
+rate_profile_rate(struct rate_profile *p, uint64_t now)
+{
+	const struct rate_point *a, *b;
+	uint64_t off, last = p->points[p->nb_points - 1].offset;
+
+	off = now - p->start;
+	if (off >= last && (p->flags & RATE_PROFILE_LOOP) && last != 0) {
+		p->start += off / last * last;
+		p->cur = 0;
+		off = now - p->start;
+	}
+	while (p->cur + 1 < p->nb_points && p->points[p->cur + 1].offset <= off)
+		p->cur++;
+	a = &p->points[p->cur];
+	if (off < a->offset) {
+		/*before the first point*/
+		p->next = p->start + a->offset;
+		return RATE_CONTROL * 1.0;
+	}
+	if (p->cur + 1 == p->nb_points) {
+		if (p->flags & RATE_PROFILE_LOOP) {
+			p->next = p->start + last + (last == 0);
+			return a->rate;
+		}
+		p->done = 1;
+		p->next = UINT64_MAX;
+		return (p->flags & RATE_PROFILE_HOLD) ? a->rate : RATE_CONTROL * 1.0;
+	}
+	b = a + 1;
+	if (!(p->flags & RATE_PROFILE_INTERP) || b->offset == a->offset) {
+		p->next = p->start + b->offset;
+		return a->rate;
+	}
+	p->next = RTE_MIN(now + p->step, p->start + b->offset);
+	return a->rate + (b->rate - a->rate) * (off - a->offset) / (b->offset - a->offset);
+}
+
+/*
+* the old DIST_MODE profiles: the shaping_dist table (DIST_FLAG 1) shrunk to
+* 0~100 every 0.5ms, or without it the 6%..100%..10% triangle
+*/
+static inline struct rate_profile *
+rate_profile_dist_mode(void)
+{
+	struct rate_profile *p;
+	const uint64_t period = us_to_tsc(500);
+	uint32_t i, n;
+	double r;
+
+	if (shaping_dist != NULL && shaping_dist->size != 0) {
+		p = rate_profile_alloc(shaping_dist->size, RATE_PROFILE_LOOP);
+		for (i = 0; i < shaping_dist->size; i++) {
+			p->points[i].offset = i * period;
+			p->points[i].pct = 1;
+			p->points[i].value = shaping_max != shaping_min ?
+				(shaping_dist->table[i] - shaping_min * 1.0) /
+				(shaping_max - shaping_min * 1.0) * 100.0 : 100.0;
+		}
+		return p;
+	}
+	/*up by 1.1% from 6% to 100%, down again to 10%, r=190 is the 10% point*/
+	for (n = 0; 6 + (n + 1) * 1.10 < 190; n++)
+		;
+	p = rate_profile_alloc(n + 1, RATE_PROFILE_LOOP);
+	for (i = 0; i <= n; i++) {
+		r = 6 + (i + 1) * 1.10;
+		p->points[i].offset = i * period;
+		p->points[i].pct = 1;
+		p->points[i].value = r < 100 ? r : 100 - (r - 100);
+	}
+	return p;
+}
+
+#endif
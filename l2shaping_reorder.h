@@ -0,0 +1,255 @@
+#ifndef _L2SHAPING_REORDER_H_
+#define _L2SHAPING_REORDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <rte_mbuf.h>
+#include <rte_malloc.h>
+#include "l2shaping.h"
+#include "l2shaping_policy.h"
+#include "l2shaping_stage.h"
+
+/*
+* reorder engine of one reorder lcore. flows (a 5-tuple hash) index a flat
+* array of REORDER_FLOWS states, flows that collide share one. a flow holds
+* back pkts in a fifo chained through pkt_meta(m)->tw_next, so nothing is
+* malloc'd per pkt, two modes like netem:
+* - swap: with probability reorder_prob a pkt is held until reorder_distance
+*   later pkts of its flow have passed it, one held pkt per flow at a time
+* - gap: every pkt is held for reorder_hold, except that after reorder_gap - 1
+*   held ones the next pkt goes out at once with probability reorder_prob,
+*   ahead of the held ones (netem "delay H reorder P gap G")
+* a flow with held pkts is on a timer wheel of flows by the deadline of its
+* oldest one, REORDER_WHEEL_SLOTS slots of 2^REORDER_TICK_SHIFT tsc; a slot
+* holds every revolution, a flow is only released once its deadline is over.
+* so idle flows let their pkts go after reorder_hold without a table scan.
+*/
+
+#define REORDER_FLOW_BITS 16		//65536 flows per reorder lcore
+#define REORDER_FLOWS (1 << REORDER_FLOW_BITS)
+#define REORDER_TICK_SHIFT 16		//about 26us at 2.5GHz
+#define REORDER_WHEEL_BITS 12
+#define REORDER_WHEEL_SLOTS (1 << REORDER_WHEEL_BITS)
+#define REORDER_NONE UINT32_MAX
+
+/*
+* output of the reorder stage: every pkt goes back to the class ring of its class,
+* one ring per flow, so the order reorder makes is the order it leaves in
+*/
+#define REORDER_OUT_SEND(m) (pkt_meta(m)->cls)
+
+enum reorder_mode {
+	REORDER_MODE_SWAP,
+	REORDER_MODE_GAP,
+};
+
+struct reorder_flow {
+	struct rte_mbuf *head;		//held pkts, oldest first
+	struct rte_mbuf *tail;
+	uint32_t nb_held;
+	uint32_t count;				//swap: pkts that passed the held one, gap: held since the last one let through
+	uint32_t tm_prev;			//flows of the same wheel slot
+	uint32_t tm_next;
+	uint32_t tm_slot;			//REORDER_NONE when the flow holds nothing
+	uint32_t pad;
+};
+
+struct reorder_engine {
+	struct reorder_flow *flows;
+	uint32_t slot[REORDER_WHEEL_SLOTS];	//first flow of every slot
+	uint64_t cur_tick;			//next tick to expire
+	uint64_t hold_tsc;
+	uint32_t threshold;			//reorder_prob in 2^32
+	uint64_t nb_pkts;
+	uint64_t nb_reordered;		//pkts that went out ahead of a held one
+	uint64_t nb_expired;		//held pkts let go by the timer
+};
+
+uint8_t reorder_mode;			//set by --reorder
+double reorder_prob;
+uint32_t reorder_distance;		//swap
+uint32_t reorder_gap;			//gap
+uint32_t reorder_hold_us;		//set by --reorder-hold-us
+
+static inline struct reorder_engine *
+reorder_engine_create(const char *name, int socket, uint64_t now)
+{
+	struct reorder_engine *e;
+	uint32_t i;
+
+	e = rte_zmalloc_socket(name, sizeof(*e), RTE_CACHE_LINE_SIZE, socket);
+	if (e == NULL)
+		return NULL;
+	e->flows = rte_zmalloc_socket(name, REORDER_FLOWS * sizeof(struct reorder_flow),
+		RTE_CACHE_LINE_SIZE, socket);
+	if (e->flows == NULL)
+		return NULL;
+	for (i = 0; i < REORDER_FLOWS; i++)
+		e->flows[i].tm_slot = REORDER_NONE;
+	for (i = 0; i < REORDER_WHEEL_SLOTS; i++)
+		e->slot[i] = REORDER_NONE;
+	e->cur_tick = now >> REORDER_TICK_SHIFT;
+	e->hold_tsc = us_to_tsc(reorder_hold_us);
+	e->threshold = reorder_prob >= 1.0 ? UINT32_MAX : (uint32_t)(reorder_prob * 4294967296.0);
+	return e;
+}
+
+/*flow state of a 5-tuple hash, fibonacci hashing spreads the bits the lcore split used*/
+static inline uint32_t
+reorder_flow_index(uint32_t hash)
+{
+	return (hash * 0x9e3779b1u) >> (32 - REORDER_FLOW_BITS);
+}
+
+static inline void
+reorder_timer_del(struct reorder_engine *e, uint32_t idx)
+{
+	struct reorder_flow *f = &e->flows[idx];
+
+	if (f->tm_prev != REORDER_NONE)
+		e->flows[f->tm_prev].tm_next = f->tm_next;
+	else
+		e->slot[f->tm_slot] = f->tm_next;
+	if (f->tm_next != REORDER_NONE)
+		e->flows[f->tm_next].tm_prev = f->tm_prev;
+	f->tm_slot = REORDER_NONE;
+}
+
+/*put the flow on the slot of the deadline of its oldest pkt*/
+static inline void
+reorder_timer_add(struct reorder_engine *e, uint32_t idx)
+{
+	struct reorder_flow *f = &e->flows[idx];
+	uint64_t tick = pkt_meta(f->head)->deadline >> REORDER_TICK_SHIFT;
+	uint32_t s;
+
+	if (tick < e->cur_tick)
+		tick = e->cur_tick;
+	s = tick & (REORDER_WHEEL_SLOTS - 1);
+	f->tm_slot = s;
+	f->tm_prev = REORDER_NONE;
+	f->tm_next = e->slot[s];
+	if (f->tm_next != REORDER_NONE)
+		e->flows[f->tm_next].tm_prev = idx;
+	e->slot[s] = idx;
+}
+
+static inline void
+reorder_hold(struct reorder_engine *e, uint32_t idx, struct rte_mbuf *m, uint64_t now)
+{
+	struct reorder_flow *f = &e->flows[idx];
+
+	pkt_meta(m)->deadline = now + e->hold_tsc;
+	pkt_meta(m)->tw_next = NULL;
+	if (f->tail != NULL)
+		pkt_meta(f->tail)->tw_next = m;
+	else
+		f->head = m;
+	f->tail = m;
+	if (f->nb_held++ == 0)
+		reorder_timer_add(e, idx);
+}
+
+static inline struct rte_mbuf *
+reorder_pop(struct reorder_flow *f)
+{
+	struct rte_mbuf *m = f->head;
+
+	f->head = pkt_meta(m)->tw_next;
+	if (f->head == NULL)
+		f->tail = NULL;
+	f->nb_held--;
+	return m;
+}
+
+/*let go every held pkt of a flow*/
+static inline void
+reorder_release(struct reorder_engine *e, uint32_t idx, struct stage *st)
+{
+	struct reorder_flow *f = &e->flows[idx];
+	struct rte_mbuf *m;
+
+	if (f->nb_held == 0)
+		return;
+	reorder_timer_del(e, idx);
+	while (f->nb_held != 0) {
+		m = reorder_pop(f);
+		stage_emit(st, REORDER_OUT_SEND(m), m);
+	}
+}
+
+/*one pkt of flow hash, rnd: 32 random bits*/
+static inline void
+reorder_pkt(struct reorder_engine *e, struct stage *st, struct rte_mbuf *m,
+	uint32_t hash, uint32_t rnd, uint64_t now)
+{
+	uint32_t idx = reorder_flow_index(hash);
+	struct reorder_flow *f = &e->flows[idx];
+
+	e->nb_pkts++;
+	if (reorder_mode == REORDER_MODE_SWAP) {
+		if (f->nb_held == 0) {
+			if (rnd < e->threshold) {
+				f->count = 0;
+				reorder_hold(e, idx, m, now);
+			} else {
+				stage_emit(st, REORDER_OUT_SEND(m), m);
+			}
+			return;
+		}
+		/*ahead of the held one, same ring so the distance holds downstream*/
+		stage_emit(st, REORDER_OUT_SEND(m), m);
+		e->nb_reordered++;
+		if (++f->count >= reorder_distance)
+			reorder_release(e, idx, st);
+		return;
+	}
+	/*gap, like netem_enqueue*/
+	if (reorder_gap == 0 || f->count < reorder_gap - 1 || rnd >= e->threshold) {
+		f->count++;
+		reorder_hold(e, idx, m, now);
+		return;
+	}
+	f->count = 0;
+	stage_emit(st, REORDER_OUT_SEND(m), m);
+	if (f->nb_held != 0)
+		e->nb_reordered++;
+}
+
+/*let go the held pkts whose deadline is over*/
+static inline void
+reorder_expire(struct reorder_engine *e, struct stage *st, uint64_t now)
+{
+	uint64_t now_tick = now >> REORDER_TICK_SHIFT;
+	uint64_t n = now_tick - e->cur_tick + 1;
+	uint32_t idx, next, s;
+	struct reorder_flow *f;
+	struct rte_mbuf *m;
+
+	if (now_tick < e->cur_tick)
+		return;
+	if (n > REORDER_WHEEL_SLOTS)
+		n = REORDER_WHEEL_SLOTS;
+	for (; n > 0; n--, e->cur_tick++) {
+		s = e->cur_tick & (REORDER_WHEEL_SLOTS - 1);
+		idx = e->slot[s];
+		e->slot[s] = REORDER_NONE;
+		/*flows due later go back, to this slot again or a later one*/
+		for (; idx != REORDER_NONE; idx = next) {
+			f = &e->flows[idx];
+			next = f->tm_next;
+			f->tm_slot = REORDER_NONE;
+			while (f->nb_held != 0 && pkt_meta(f->head)->deadline <= now) {
+				m = reorder_pop(f);
+				stage_emit(st, REORDER_OUT_SEND(m), m);
+				e->nb_expired++;
+			}
+			if (f->nb_held != 0)
+				reorder_timer_add(e, idx);
+		}
+	}
+	/*the current tick is not over, look at it again*/
+	e->cur_tick = now_tick;
+}
+
+#endif
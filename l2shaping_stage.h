@@ -0,0 +1,207 @@
+#ifndef _L2SHAPING_STAGE_H_
+#define _L2SHAPING_STAGE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <rte_ring.h>
+#include <rte_mbuf.h>
+#include <rte_lcore.h>
+#include <rte_debug.h>
+#include "l2shaping.h"
+
+/*
+* pipeline stage: one or more input rings, a set of output rings and counters.
+* a worker polls a burst from its inputs, emits each packet to an output,
+* and flushes the outputs once per loop, so every hop costs one ring op per burst.
+*/
+
+#define STAGE_BURST_SIZE 64
+/*one per send class + drop + one per delay instance + one per reorder instance*/
+#define STAGE_MAX_OUTPUTS (C2S_MAX_CLASSES+1+2*MAX_STAGE_INSTANCES)
+
+struct stage_stats {
+	uint64_t rx;			//pkts taken from the input rings
+	uint64_t tx;			//pkts put on the output rings
+	uint64_t drop;			//pkts freed because an output ring was full (rx: shed by overload policy)
+	uint64_t drop_highpri;	//high priority pkts among drop
+	uint64_t refused;		//pkts freed because the stage itself had no room (delay line full)
+	uint64_t busy_polls;	//polls that got at least one pkt
+	uint64_t idle_polls;	//polls that got nothing
+	uint64_t blocked_polls;	//polls skipped because an output ring had no room
+};
+
+struct stage_out {
+	struct rte_ring *ring;
+	uint16_t len;
+	uint8_t shed;			//left out of the credit, what does not fit is dropped
+	struct rte_mbuf *m_table[STAGE_BURST_SIZE];
+};
+
+struct stage {
+	const char *name;
+	uint8_t instance;
+	uint16_t nb_in;
+	uint16_t next_in;
+	struct rte_ring *in[MAX_STAGE_INSTANCES];
+	uint16_t nb_out;
+	struct stage_stats stats;
+	struct stage_out out[STAGE_MAX_OUTPUTS];
+} __rte_cache_aligned;
+
+/*stage run by each lcore, read by the print lcore*/
+struct stage *lcore_stage[RTE_MAX_LCORE];
+
+/*
+* create a ring with the SP/SC flags its real number of producers and consumers allows,
+* a ring with one producer (consumer) must only be used by that lcore.
+*/
+static inline struct rte_ring *
+stage_ring_create(const char *name, unsigned count, unsigned nb_prod, unsigned nb_cons)
+{
+	struct rte_ring *r;
+	unsigned flags = 0;
+
+	if (nb_prod <= 1)
+		flags |= RING_F_SP_ENQ;
+	if (nb_cons <= 1)
+		flags |= RING_F_SC_DEQ;
+	r = rte_ring_create(name, count, SOCKET_ID_ANY, flags);
+	if (r == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create ring %s\n", name);
+	return r;
+}
+
+static inline void
+stage_init(struct stage *st, const char *name)
+{
+	memset(st, 0, sizeof(*st));
+	st->name = name;
+	st->instance = lcore_role[rte_lcore_id()].instance;
+	lcore_stage[rte_lcore_id()] = st;
+}
+
+static inline void
+stage_add_input(struct stage *st, struct rte_ring *r)
+{
+	if (st->nb_in >= MAX_STAGE_INSTANCES)
+		rte_exit(EXIT_FAILURE, "stage %s: too many input rings\n", st->name);
+	st->in[st->nb_in++] = r;
+}
+
+/*return the output index*/
+static inline int
+stage_add_output(struct stage *st, struct rte_ring *r)
+{
+	if (st->nb_out >= STAGE_MAX_OUTPUTS)
+		rte_exit(EXIT_FAILURE, "stage %s: too many output rings\n", st->name);
+	st->out[st->nb_out].ring = r;
+	return st->nb_out++;
+}
+
+/*
+* an output that never holds the stage back: a full ring drops the pkts for it
+* (counted in drop) instead, so one slow consumer does not stall the others
+*/
+static inline int
+stage_add_shed_output(struct stage *st, struct rte_ring *r)
+{
+	int o = stage_add_output(st, r);
+
+	st->out[o].shed = 1;
+	return o;
+}
+
+/*
+* credit: room left downstream, the smallest free count of the output rings
+* minus what is already buffered for them, shed outputs do not count
+*/
+static inline unsigned
+stage_credit(struct stage *st)
+{
+	unsigned i, free, credit = UINT32_MAX;
+
+	for (i = 0; i < st->nb_out; i++) {
+		if (st->out[i].ring == NULL || st->out[i].shed)
+			continue;
+		free = rte_ring_free_count(st->out[i].ring);
+		free = free > st->out[i].len ? free - st->out[i].len : 0;
+		if (free < credit)
+			credit = free;
+	}
+	return credit;
+}
+
+/*
+* burst dequeue from the inputs, round robin from the one after the last busy ring,
+* no rte_ring_count before, an empty ring just returns 0.
+* never takes more than the credit, a full downstream ring leaves the pkts
+* upstream so the backpressure reaches the rx lcores, where they are shed
+*/
+static inline unsigned
+stage_poll(struct stage *st, struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned i, nb = 0, credit;
+	uint16_t in = st->next_in;
+
+	credit = stage_credit(st);
+	if (unlikely(credit < n))
+		n = credit;
+	if (unlikely(n == 0)) {
+		st->stats.blocked_polls++;
+		return 0;
+	}
+	for (i = 0; i < st->nb_in; i++) {
+		nb = rte_ring_dequeue_burst(st->in[in], (void **)pkts, n, NULL);
+		if (++in == st->nb_in)
+			in = 0;
+		if (nb != 0)
+			break;
+	}
+	st->next_in = in;
+	if (nb == 0) {
+		st->stats.idle_polls++;
+		return 0;
+	}
+	st->stats.busy_polls++;
+	st->stats.rx += nb;
+	return nb;
+}
+
+static inline void
+stage_flush_out(struct stage *st, struct stage_out *out)
+{
+	unsigned n, i;
+
+	if (out->len == 0)
+		return;
+	n = rte_ring_enqueue_burst(out->ring, (void **)out->m_table, out->len, NULL);
+	st->stats.tx += n;
+	if (unlikely(n < out->len)) {
+		st->stats.drop += out->len - n;
+		for (i = n; i < out->len; i++)
+			rte_pktmbuf_free(out->m_table[i]);
+	}
+	out->len = 0;
+}
+
+/*buffer one pkt for output o, the burst goes out when full or on stage_flush*/
+static inline void
+stage_emit(struct stage *st, int o, struct rte_mbuf *m)
+{
+	struct stage_out *out = &st->out[o];
+
+	out->m_table[out->len++] = m;
+	if (unlikely(out->len == STAGE_BURST_SIZE))
+		stage_flush_out(st, out);
+}
+
+static inline void
+stage_flush(struct stage *st)
+{
+	uint16_t i;
+
+	for (i = 0; i < st->nb_out; i++)
+		stage_flush_out(st, &st->out[i]);
+}
+
+#endif
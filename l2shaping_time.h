@@ -0,0 +1,122 @@
+#ifndef _L2SHAPING_TIME_H_
+#define _L2SHAPING_TIME_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <rte_cycles.h>
+#include <rte_pause.h>
+
+/*
+* one time base for every stage: the tsc. timestamps and deadlines are
+* uint64_t tsc cycles, ns<->cycles goes through fixed point factors
+* calibrated once in time_init, so the fast path has no syscall and no division.
+*/
+
+#define TIME_CALIB_MS 100		//how long time_init measures the tsc against CLOCK_MONOTONIC_RAW
+#define TIME_FP_SHIFT 24		//fixed point of the conversion factors, ns_to_tsc is exact up to ~270s
+
+uint64_t tsc_hz;			//calibrated tsc cycles per second
+uint64_t tsc_per_ns_fp;		//tsc cycles per ns << TIME_FP_SHIFT
+uint64_t ns_per_tsc_fp;		//ns per tsc cycle << TIME_FP_SHIFT
+uint64_t time_base_tsc;		//tsc at time_init
+uint64_t time_base_wall_ns;	//CLOCK_REALTIME at time_init, to print wall clock times
+
+static inline uint64_t
+time_now(void)
+{
+	return rte_rdtsc();
+}
+
+static inline uint64_t
+ns_to_tsc(uint64_t ns)
+{
+	return (ns * tsc_per_ns_fp) >> TIME_FP_SHIFT;
+}
+
+static inline uint64_t
+us_to_tsc(uint64_t us)
+{
+	return ns_to_tsc(us * 1000);
+}
+
+static inline uint64_t
+ms_to_tsc(uint64_t ms)
+{
+	return ms * (tsc_hz / MS_PER_S);
+}
+
+/*for intervals up to ~15 min (gaps, delays), longer ones use tsc_to_sec*/
+static inline uint64_t
+tsc_to_ns(uint64_t cycles)
+{
+	return (cycles * ns_per_tsc_fp) >> TIME_FP_SHIFT;
+}
+
+static inline uint64_t
+tsc_to_ms(uint64_t cycles)
+{
+	return cycles / (tsc_hz / MS_PER_S);
+}
+
+static inline uint64_t
+tsc_to_sec(uint64_t cycles)
+{
+	return cycles / tsc_hz;
+}
+
+/*wall clock second of a tsc timestamp*/
+static inline uint64_t
+time_wall_sec(uint64_t tsc)
+{
+	uint64_t cycles = tsc - time_base_tsc;
+
+	return (time_base_wall_ns + cycles % tsc_hz * NS_PER_S / tsc_hz) / NS_PER_S
+		+ cycles / tsc_hz;
+}
+
+/*spin until the tsc passes deadline, return the tsc it was left at*/
+static inline uint64_t
+time_wait_until(uint64_t deadline)
+{
+	uint64_t now;
+
+	while ((now = rte_rdtsc()) < deadline)
+		rte_pause();
+	return now;
+}
+
+static inline uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * NS_PER_S + ts->tv_nsec;
+}
+
+/*
+* measure the tsc against CLOCK_MONOTONIC_RAW, rte_get_tsc_hz may come from
+* a short estimate at eal init. must run on the master lcore before the workers start
+*/
+static inline void
+time_init(void)
+{
+	struct timespec t0, t1, wall;
+	uint64_t c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = rte_rdtsc_precise();
+	rte_delay_ms(TIME_CALIB_MS);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = rte_rdtsc_precise();
+	ns = timespec_to_ns(&t1) - timespec_to_ns(&t0);
+	tsc_hz = ns != 0 ? (c1 - c0) * NS_PER_S / ns : rte_get_tsc_hz();
+	tsc_per_ns_fp = (tsc_hz << TIME_FP_SHIFT) / NS_PER_S;
+	ns_per_tsc_fp = ((uint64_t)NS_PER_S << TIME_FP_SHIFT) / tsc_hz;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	time_base_tsc = rte_rdtsc();
+	time_base_wall_ns = timespec_to_ns(&wall);
+	printf("tsc calibrated to %lu Hz (eal says %lu Hz)\n",
+		(unsigned long)tsc_hz, (unsigned long)rte_get_tsc_hz());
+}
+
+#endif
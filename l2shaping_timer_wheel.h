@@ -0,0 +1,229 @@
+#ifndef _L2SHAPING_TIMER_WHEEL_H_
+#define _L2SHAPING_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <rte_mbuf.h>
+#include <rte_malloc.h>
+#include "l2shaping.h"
+
+/*
+* hierarchical timer wheel of mbufs keyed by pkt_meta(m)->deadline (tsc).
+* one tick is 2^TIMER_WHEEL_TICK_SHIFT tsc cycles, level l slot covers 2^(8*l) ticks,
+* a slot of a higher level is cascaded down when the lower level wraps.
+* the pkts are chained through pkt_meta(m)->tw_next, so insert and expiry are O(1)
+* and the wheel holds as many pkts as the mbuf pools do.
+* pkts whose deadline is not before the last queued one go to a plain FIFO instead,
+* a constant delay flow never touches the wheel and keeps its order.
+* pkts of one tick come out in the order they went in, and the fifo and the wheel
+* are merged by deadline, so pkts of nondecreasing deadlines keep their order.
+*/
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 8
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+/*ticks the wheel can hold, later deadlines are clamped to the last slot*/
+#define TW_MAX_TICKS ((1ULL << (TW_SLOT_BITS * TW_LEVELS)) - 1)
+
+struct tw_list {
+	struct rte_mbuf *head;
+	struct rte_mbuf *tail;
+	uint32_t len;
+};
+
+struct timer_wheel {
+	uint64_t cur_tick;		//next tick to expire
+	uint64_t nb_wheel;		//pkts in the slots
+	uint64_t fifo_last;		//deadline of the last pkt put on the fifo
+	struct tw_list due;		//expired, waiting for room downstream
+	struct tw_list fifo;	//monotone fast path
+	uint64_t nb_fifo_in;	//pkts that took the fast path
+	uint64_t nb_wheel_in;	//pkts that went in the wheel
+	struct tw_list slot[TW_LEVELS][TW_SLOTS];
+} __rte_cache_aligned;
+
+static inline void
+tw_list_append(struct tw_list *l, struct rte_mbuf *m)
+{
+	pkt_meta(m)->tw_next = NULL;
+	if (l->tail != NULL)
+		pkt_meta(l->tail)->tw_next = m;
+	else
+		l->head = m;
+	l->tail = m;
+	l->len++;
+}
+
+static inline struct rte_mbuf *
+tw_list_pop(struct tw_list *l)
+{
+	struct rte_mbuf *m = l->head;
+
+	l->head = pkt_meta(m)->tw_next;
+	if (l->head == NULL)
+		l->tail = NULL;
+	l->len--;
+	return m;
+}
+
+static inline void
+tw_list_push(struct tw_list *l, struct rte_mbuf *m)
+{
+	pkt_meta(m)->tw_next = l->head;
+	if (l->head == NULL)
+		l->tail = m;
+	l->head = m;
+	l->len++;
+}
+
+static inline void
+tw_list_reverse(struct tw_list *l)
+{
+	struct tw_list r = {NULL, NULL, 0};
+
+	while (l->head != NULL)
+		tw_list_push(&r, tw_list_pop(l));
+	*l = r;
+}
+
+/*move all of src to the tail of dst*/
+static inline void
+tw_list_splice(struct tw_list *dst, struct tw_list *src)
+{
+	if (src->head == NULL)
+		return;
+	if (dst->tail != NULL)
+		pkt_meta(dst->tail)->tw_next = src->head;
+	else
+		dst->head = src->head;
+	dst->tail = src->tail;
+	dst->len += src->len;
+	src->head = src->tail = NULL;
+	src->len = 0;
+}
+
+static inline struct timer_wheel *
+tw_create(const char *name, uint64_t now)
+{
+	struct timer_wheel *tw;
+
+	tw = rte_zmalloc_socket(name, sizeof(*tw), RTE_CACHE_LINE_SIZE, rte_socket_id());
+	if (tw != NULL)
+		tw->cur_tick = now >> TIMER_WHEEL_TICK_SHIFT;
+	return tw;
+}
+
+static inline uint64_t
+tw_count(const struct timer_wheel *tw)
+{
+	return tw->nb_wheel + tw->due.len + tw->fifo.len;
+}
+
+/*front: the pkt goes ahead of the pkts of its tick, see tw_cascade*/
+static inline void
+tw_wheel_add(struct timer_wheel *tw, struct rte_mbuf *m, int front)
+{
+	uint64_t tick = pkt_meta(m)->deadline >> TIMER_WHEEL_TICK_SHIFT;
+	uint64_t diff;
+	int level;
+
+	if (tick < tw->cur_tick) {
+		tw_list_append(&tw->due, m);
+		return;
+	}
+	diff = tick - tw->cur_tick;
+	if (unlikely(diff > TW_MAX_TICKS)) {
+		diff = TW_MAX_TICKS;
+		tick = tw->cur_tick + diff;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (diff < (1ULL << (TW_SLOT_BITS * (level + 1))))
+			break;
+	if (front)
+		tw_list_push(&tw->slot[level][(tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK], m);
+	else
+		tw_list_append(&tw->slot[level][(tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK], m);
+	tw->nb_wheel++;
+}
+
+static inline void
+tw_insert(struct timer_wheel *tw, struct rte_mbuf *m)
+{
+	uint64_t deadline = pkt_meta(m)->deadline;
+
+	if (tw->fifo.len == 0 || deadline >= tw->fifo_last) {
+		tw_list_append(&tw->fifo, m);
+		tw->fifo_last = deadline;
+		tw->nb_fifo_in++;
+		return;
+	}
+	tw_wheel_add(tw, m, 0);
+	tw->nb_wheel_in++;
+}
+
+/*
+* re-add the pkts of a higher level slot, they land in lower levels.
+* a pkt only sits in a higher level than another of its tick if it went in
+* earlier, so the cascaded pkts go ahead of the ones in the lower slots;
+* pushed to the front in reverse they keep their own order too.
+*/
+static inline int
+tw_cascade(struct timer_wheel *tw, int level, int idx)
+{
+	struct tw_list l = tw->slot[level][idx];
+
+	tw->slot[level][idx].head = tw->slot[level][idx].tail = NULL;
+	tw->slot[level][idx].len = 0;
+	tw->nb_wheel -= l.len;
+	tw_list_reverse(&l);
+	while (l.head != NULL)
+		tw_wheel_add(tw, tw_list_pop(&l), 1);
+	return idx;
+}
+
+/*expire every tick before now_tick, the slot pkts go to the due list*/
+static inline void
+tw_advance(struct timer_wheel *tw, uint64_t now_tick)
+{
+	int idx, level;
+
+	while (tw->cur_tick < now_tick) {
+		if (tw->nb_wheel == 0) {
+			tw->cur_tick = now_tick;
+			return;
+		}
+		idx = tw->cur_tick & TW_SLOT_MASK;
+		if (idx == 0)
+			for (level = 1; level < TW_LEVELS; level++)
+				if (tw_cascade(tw, level,
+						(tw->cur_tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK) != 0)
+					break;
+		tw->nb_wheel -= tw->slot[0][idx].len;
+		tw_list_splice(&tw->due, &tw->slot[0][idx]);
+		tw->cur_tick++;
+	}
+}
+
+/*
+* take up to n pkts whose deadline is before now, what is left stays
+* due and goes out first on the next call
+*/
+static inline unsigned
+tw_expire(struct timer_wheel *tw, uint64_t now, struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned nb = 0;
+
+	tw_advance(tw, now >> TIMER_WHEEL_TICK_SHIFT);
+	while (nb < n && tw->due.head != NULL) {
+		if (tw->fifo.head != NULL && pkt_meta(tw->fifo.head)->deadline < now &&
+				pkt_meta(tw->fifo.head)->deadline <= pkt_meta(tw->due.head)->deadline)
+			pkts[nb++] = tw_list_pop(&tw->fifo);
+		else
+			pkts[nb++] = tw_list_pop(&tw->due);
+	}
+	while (nb < n && tw->fifo.head != NULL && pkt_meta(tw->fifo.head)->deadline < now)
+		pkts[nb++] = tw_list_pop(&tw->fifo);
+	return nb;
+}
+
+#endif
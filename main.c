@@ -14,6 +14,7 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <arpa/inet.h>
 
 #include <rte_common.h>
 #include <rte_vect.h>
@@ -47,6 +48,14 @@
 
 #include "l2shaping.h"
 #include "l2shaping_policy.h"
+#include "l2shaping_stage.h"
+#include "l2shaping_gap_sched.h"
+#include "l2shaping_rate_profile.h"
+#include "l2shaping_mm_trace.h"
+#include "l2shaping_rand.h"
+#include "l2shaping_dist.h"
+#include "l2shaping_flow_delay.h"
+#include "l2shaping_reorder.h"
 #include <unistd.h>
 #include <execinfo.h>
 #include <time.h>
@@ -81,6 +90,7 @@ static int parse_ptype; /**< Parse packet type using rx callback, and */
 			/**< disabled by default */
 static int per_port_pool; /**< Use separate buffer pools per port; disabled */
 			  /**< by default */
+static const char *delay_rules_file; /**< Loaded once the delay sampler is built */
 
 volatile bool force_quit;
 
@@ -120,6 +130,53 @@ static struct lcore_params * lcore_params = lcore_params_array_default;
 static uint16_t nb_lcore_params = sizeof(lcore_params_array_default) /
 				sizeof(lcore_params_array_default[0]);
 
+struct lcore_role_conf lcore_role[RTE_MAX_LCORE];
+uint16_t nb_role_instances[LCORE_ROLE_MAX];
+
+const char *lcore_role_names[LCORE_ROLE_MAX] = {
+	[LCORE_ROLE_NONE]       = "none",
+	[LCORE_ROLE_C2S_RX]     = "c2s_rx",
+	[LCORE_ROLE_S2C_RX]     = "s2c_rx",
+	[LCORE_ROLE_POLICY]     = "policy",
+	[LCORE_ROLE_C2S_TX]     = "c2s_tx",
+	[LCORE_ROLE_S2C_TX]     = "s2c_tx",
+	[LCORE_ROLE_C2S_FILTER] = "c2s_filter",
+	[LCORE_ROLE_S2C_FILTER] = "s2c_filter",
+	[LCORE_ROLE_PRINT]      = "print",
+	[LCORE_ROLE_DROP]       = "drop",
+	[LCORE_ROLE_DELAY]      = "delay",
+	[LCORE_ROLE_REORDER]    = "reorder",
+	[LCORE_ROLE_DUMP]       = "dump",
+	[LCORE_ROLE_C2S_RTC]    = "c2s_rtc",
+	[LCORE_ROLE_GAP_GEN]    = "gap_gen",
+};
+
+struct lcore_role_params {
+	uint8_t lcore_id;
+	uint8_t role;
+};
+
+static struct lcore_role_params lcore_role_params_array[RTE_MAX_LCORE];
+static struct lcore_role_params lcore_role_params_array_default[] = {
+	{1, LCORE_ROLE_C2S_RX},
+	{2, LCORE_ROLE_S2C_RX},
+	{3, LCORE_ROLE_POLICY},
+	{4, LCORE_ROLE_C2S_TX},
+	{5, LCORE_ROLE_S2C_TX},
+	{6, LCORE_ROLE_C2S_FILTER},
+	{7, LCORE_ROLE_S2C_FILTER},
+	{8, LCORE_ROLE_PRINT},
+	{9, LCORE_ROLE_DROP},
+	{10, LCORE_ROLE_DELAY},
+	{11, LCORE_ROLE_REORDER},
+};
+
+static struct lcore_role_params *lcore_role_params = lcore_role_params_array_default;
+/*--c2s-sender was given, else options that only one sender follows pick it*/
+static int c2s_sender_given;
+static uint16_t nb_lcore_role_params = sizeof(lcore_role_params_array_default) /
+				sizeof(lcore_role_params_array_default[0]);
+
 static struct rte_eth_conf port_conf = {
 	.rxmode = {
 		.mq_mode = ETH_MQ_RX_RSS,
@@ -130,7 +187,7 @@ static struct rte_eth_conf port_conf = {
 	.rx_adv_conf = {
 		.rss_conf = {
 			.rss_key = NULL,
-			.rss_hf = ETH_RSS_IP,
+			.rss_hf = ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP,
 		},
 	},
 	.txmode = {
@@ -263,6 +320,173 @@ init_lcore_rx_queues(void)
 	return 0;
 }
 
+static int
+role_allows_instances(uint8_t role)
+{
+	return role == LCORE_ROLE_C2S_RX || role == LCORE_ROLE_S2C_RX ||
+		role == LCORE_ROLE_C2S_FILTER || role == LCORE_ROLE_DELAY ||
+		role == LCORE_ROLE_REORDER;
+}
+
+/* rx lcores poll the queues --config gives them, those must be on their port */
+static int
+check_lcore_role_queues(void)
+{
+	unsigned lcore;
+	uint16_t i, port;
+
+	for (lcore = 0; lcore < RTE_MAX_LCORE; lcore++) {
+		switch (lcore_role[lcore].role) {
+		case LCORE_ROLE_C2S_RX:
+		case LCORE_ROLE_C2S_RTC:
+			port = PORT_TO_CLIENT;
+			break;
+		case LCORE_ROLE_S2C_RX:
+			port = PORT_TO_SERVER;
+			break;
+		default:
+			if (lcore_conf[lcore].n_rx_queue != 0)
+				printf("warning: lcore %u (%s) does not poll its rx queues\n",
+					lcore, lcore_role_names[lcore_role[lcore].role]);
+			continue;
+		}
+		for (i = 0; i < lcore_conf[lcore].n_rx_queue; i++) {
+			if (lcore_conf[lcore].rx_queue_list[i].port_id != port) {
+				printf("error: lcore %u (%s) is given a queue of port %u, "
+					"it may only poll port %u\n", lcore,
+					lcore_role_names[lcore_role[lcore].role],
+					lcore_conf[lcore].rx_queue_list[i].port_id, port);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+init_lcore_roles(void)
+{
+	uint16_t i;
+	uint8_t lcore, role;
+	int rate_follow;
+
+	memset(lcore_role, 0, sizeof(lcore_role));
+	memset(nb_role_instances, 0, sizeof(nb_role_instances));
+
+	for (i = 0; i < nb_lcore_role_params; ++i) {
+		lcore = lcore_role_params[i].lcore_id;
+		role = lcore_role_params[i].role;
+		if (!rte_lcore_is_enabled(lcore)) {
+			/* the built-in map may name lcores that -l left out */
+			if (lcore_role_params == lcore_role_params_array_default)
+				continue;
+			printf("error: lcore %hhu of role %s is not enabled in lcore mask\n",
+				lcore, lcore_role_names[role]);
+			return -1;
+		}
+		if (lcore_role[lcore].role != LCORE_ROLE_NONE) {
+			printf("error: lcore %hhu has two roles: %s and %s\n", lcore,
+				lcore_role_names[lcore_role[lcore].role],
+				lcore_role_names[role]);
+			return -1;
+		}
+		if (nb_role_instances[role] >= MAX_STAGE_INSTANCES ||
+				(nb_role_instances[role] > 0 &&
+				!role_allows_instances(role))) {
+			printf("error: too many lcores for role %s\n",
+				lcore_role_names[role]);
+			return -1;
+		}
+		lcore_role[lcore].role = role;
+		lcore_role[lcore].instance = nb_role_instances[role]++;
+	}
+
+	if (nb_role_instances[LCORE_ROLE_C2S_RTC] != 0 &&
+			(nb_role_instances[LCORE_ROLE_C2S_RX] != 0 ||
+			nb_role_instances[LCORE_ROLE_C2S_FILTER] != 0 ||
+			nb_role_instances[LCORE_ROLE_C2S_TX] != 0)) {
+		printf("error: c2s_rtc can not be used with c2s_rx, c2s_filter or c2s_tx\n");
+		return -1;
+	}
+	/*
+	* c2s_rtc sends its unimpaired pkts at once, only the impaired ones coming
+	* back go through the class scheduler
+	*/
+	if (nb_role_instances[LCORE_ROLE_C2S_RTC] != 0) {
+		for (i = 0; i < C2S_MAX_CLASSES; i++)
+			if (c2s_class_rate[i] != 0 || c2s_class_ceil[i] != 0) {
+				printf("error: c2s_rtc does not apply --class-rate\n");
+				return -1;
+			}
+		if (c2s_nb_classes > C2S_CLASS_DEFAULT + 1)
+			printf("warning: c2s_rtc only applies --class-map and "
+				"--class-quantum to delayed and reordered pkts\n");
+		if (BUFFER_TIME != 0 && nb_role_instances[LCORE_ROLE_POLICY] != 0)
+			printf("warning: c2s_rtc does not wait for the BUFFER_TIME of the policy lcore\n");
+	}
+	/*every impairment the filter or c2s_rtc sends pkts to needs an lcore taking them*/
+	if (nb_role_instances[LCORE_ROLE_C2S_FILTER] != 0 ||
+			nb_role_instances[LCORE_ROLE_C2S_RTC] != 0) {
+		if (DROP_RATIO > 0 && nb_role_instances[LCORE_ROLE_DROP] == 0) {
+			printf("error: DROP_RATIO is set but there is no drop lcore\n");
+			return -1;
+		}
+		if (DELAY_MODE_OPEN && nb_role_instances[LCORE_ROLE_DELAY] == 0) {
+			printf("error: DELAY_MODE_OPEN is set but there is no delay lcore\n");
+			return -1;
+		}
+		if (REORDER_MODE_OPEN && nb_role_instances[LCORE_ROLE_REORDER] == 0) {
+			printf("error: REORDER_MODE_OPEN is set but there is no reorder lcore\n");
+			return -1;
+		}
+	}
+	if (nb_role_instances[LCORE_ROLE_GAP_GEN] != 0 &&
+			nb_role_instances[LCORE_ROLE_C2S_TX] == 0)
+		printf("warning: gap_gen lcore without c2s_tx lcore\n");
+	if (mm_trace != NULL && nb_role_instances[LCORE_ROLE_C2S_TX] == 0)
+		printf("warning: --mm-trace is only used by the c2s_tx lcore\n");
+	/*only the rate sender paces to a pkt rate, c2s_rtc and the mm-trace sender do not*/
+	if (rate_pps != 0) {
+		if (mm_trace != NULL || nb_role_instances[LCORE_ROLE_C2S_TX] == 0) {
+			printf("error: --rate-pps is only used by the rate sender of the c2s_tx lcore\n");
+			return -1;
+		}
+		if (c2s_sender_given && c2s_sender != C2S_SENDER_RATE) {
+			printf("error: --rate-pps needs --c2s-sender rate\n");
+			return -1;
+		}
+		c2s_sender = C2S_SENDER_RATE;
+	}
+	/*a rate trace moves current_rate, the rate sender and c2s_rtc follow it*/
+#ifdef DIST_MODE
+	rate_follow = 1;
+#else
+	rate_follow = rate_profile != NULL;
+#endif
+	if (rate_follow && nb_role_instances[LCORE_ROLE_C2S_TX] != 0) {
+		if (mm_trace != NULL)
+			printf("warning: the mm-trace sender does not follow the rate trace\n");
+		else if (!c2s_sender_given)
+			c2s_sender = C2S_SENDER_RATE;
+		else if (c2s_sender != C2S_SENDER_RATE)
+			printf("warning: only --c2s-sender rate follows the rate trace\n");
+	}
+	if (mm_trace == NULL && nb_role_instances[LCORE_ROLE_C2S_TX] != 0)
+		printf("c2s_tx sender: %s\n", c2s_sender == C2S_SENDER_TIMER ? "timer" :
+			c2s_sender == C2S_SENDER_TRAIN ? "train" : "rate");
+	if (nb_role_instances[LCORE_ROLE_GAP_GEN] != 0 &&
+			(mm_trace != NULL || c2s_sender == C2S_SENDER_RATE))
+		printf("warning: gap_gen lcore is only used by the timer and train senders\n");
+	if (nb_role_instances[LCORE_ROLE_C2S_TX] == 0 &&
+			nb_role_instances[LCORE_ROLE_C2S_RTC] == 0)
+		printf("warning: no c2s_tx lcore, nothing will be sent to server\n");
+	if (!rx_shared_ring && nb_role_instances[LCORE_ROLE_C2S_FILTER] >
+			nb_role_instances[LCORE_ROLE_C2S_RX])
+		printf("warning: more c2s_filter than c2s_rx lcores, "
+			"use --rx-shared-ring to keep all filters busy\n");
+	return check_lcore_role_queues();
+}
+
 /* display usage */
 static void
 print_usage(const char *prgname)
@@ -273,6 +497,25 @@ print_usage(const char *prgname)
 		" [-E]"
 		" [-L]"
 		" --config (port,queue,lcore)[,(port,queue,lcore)]"
+		" [--lcore-role (lcore,role)[,(lcore,role)]]"
+		" [--rx-shared-ring]"
+		" [--overload-policy taildrop|keep-highpri]"
+		" [--c2s-sender timer|train|rate]"
+		" [--rate-pps PPS]"
+		" [--rate-trace FILE [--rate-trace-mode loop,interp,hold]]"
+		" [--mm-trace FILE]"
+		" [--seed N]"
+		" [--delay-rules FILE [--flow-table-size N]]"
+		" [--delay-corr PCT]"
+		" [--delay-order reorder|keep]"
+		" [--delay-line-rate MBPS] [--delay-line-ms MS]"
+		" [--delay-arena-ms MS]"
+		" [--reorder swap,PCT,DIST|gap,PCT,GAP] [--reorder-hold-us US]"
+		" [--class-by marker|dscp|pcp|vlan|dst]"
+		" [--class-map (value,class)[,(value,class)]]"
+		" [--class-prefix (a.b.c.d/len,class)[,(a.b.c.d/len,class)]]"
+		" [--class-quantum (class,bytes)[,(class,bytes)]]"
+		" [--class-rate (class,rate,ceil)[,(class,rate,ceil)]]"
 		" [--eth-dest=X,MM:MM:MM:MM:MM:MM]"
 		" [--enable-jumbo [--max-pkt-len PKTLEN]]"
 		" [--no-numa]"
@@ -286,6 +529,69 @@ print_usage(const char *prgname)
 		"  -E : Enable exact match\n"
 		"  -L : Enable longest prefix match (default)\n"
 		"  --config (port,queue,lcore): Rx queue configuration\n"
+		"  --lcore-role (lcore,role): Pipeline stage of each lcore, role is one of\n"
+		"                 c2s_rx s2c_rx policy c2s_tx s2c_tx c2s_filter s2c_filter\n"
+		"                 print drop delay reorder dump c2s_rtc gap_gen; c2s_filter, delay\n"
+		"                 and reorder may be given to several lcores, c2s_rtc\n"
+		"                 does c2s rx, filter and paced tx on one lcore, gap_gen\n"
+		"                 precomputes the pkt departures of c2s_tx;\n"
+		"                 c2s_rx and s2c_rx may be given to several lcores too,\n"
+		"                 each polls the rx queues --config gives it\n"
+		"  --rx-shared-ring: c2s_rx lcores feed one shared ring instead of\n"
+		"                 one ring each, any c2s_filter lcore may take any packet\n"
+		"  --overload-policy: What rx does with packets its ring can not take,\n"
+		"                 taildrop (default) or keep-highpri to drop low\n"
+		"                 priority packets first\n"
+		"  --c2s-sender: How c2s_tx paces, timer waits out the drawn gap of\n"
+		"                 every pkt, train sends the drawn gaps as void pkts\n"
+		"                 in bursts, rate fills to the rate with void pkts\n"
+		"                 (default timer, rate with GAP_DIST_MODE 0)\n"
+		"  --rate-pps PPS: Pace c2s to PPS packets per second instead of\n"
+		"                 a ratio of the line rate, implies --c2s-sender rate\n"
+		"  --rate-trace FILE: Replay the c2s rate from FILE, lines of\n"
+		"                 '<offset us> <Mbps>' or '<offset us> <percent>%%'\n"
+		"                 (c2s_rtc or --c2s-sender rate, which it implies)\n"
+		"  --rate-trace-mode: loop the trace, interp between the points,\n"
+		"                 hold the last rate after the end (default: back\n"
+		"                 to RATE_CONTROL)\n"
+		"  --mm-trace FILE: c2s_tx sends only at the delivery opportunities\n"
+		"                 of a mahimahi trace (one ms per line, 1500 bytes\n"
+		"                 each) instead of pacing to a rate\n"
+		"  --seed N: Seed of the drop, gap and delay draws, a run with the\n"
+		"                 same seed and lcore roles draws the same numbers\n"
+		"  --delay-rules FILE: Delay profiles of flows and client prefixes,\n"
+		"                 see l2shaping_flow_delay.h for the rules\n"
+		"  --flow-table-size N: Flows the delay lcores keep together\n"
+		"                 (default 16M), idle flows age out\n"
+		"  --delay-corr PCT: Correlation of the delays of successive pkts,\n"
+		"                 0-100 (default DELAY_CORR)\n"
+		"  --delay-order: Delay jitter may reorder a flow (reorder) or each\n"
+		"                 pkt waits for the one ahead of it in its flow (keep)\n"
+		"  --delay-line-rate MBPS: Rate the delay lcores hold for the longest\n"
+		"                 delay (default DELAY_LINE_RATE_MBPS), more is dropped\n"
+		"  --delay-line-ms MS: Longest delay the line is sized for (default:\n"
+		"                 the longest the delay profiles draw)\n"
+		"  --delay-arena-ms MS: Pkts delayed longer than MS wait copied into a\n"
+		"                 compact arena and their mbufs go back to the pool\n"
+		"  --reorder: swap,PCT,DIST holds PCT%% of the pkts of the reorder\n"
+		"                 lcores until DIST later pkts of their flow passed;\n"
+		"                 gap,PCT,GAP holds every pkt but after GAP-1 held ones\n"
+		"                 sends the next at once with PCT%%, like netem\n"
+		"  --reorder-hold-us US: Longest a held pkt waits (default\n"
+		"                 REORDER_HOLD_US)\n"
+		"  --class-by: Field that picks the send class, the payload marker\n"
+		"                 byte (default), the ip dscp, the vlan pcp, the vlan id\n"
+		"                 or the server address (dst, by --class-prefix)\n"
+		"  --class-map (value,class): Send class 1-7 of a field value, values\n"
+		"                 not given go to class 1; class 0 is delay and reorder\n"
+		"                 output and is sent first, the others share by DRR\n"
+		"  --class-quantum (class,bytes): DRR quantum of a send class in wire\n"
+		"                 bytes, the share of the class is quantum/sum of quanta\n"
+		"  --class-prefix (a.b.c.d/len,class): Send class of a server prefix,\n"
+		"                 the longest prefix wins\n"
+		"  --class-rate (class,rate,ceil): Guaranteed rate and ceiling of a\n"
+		"                 send class in Mbps (0: none), a class over its rate\n"
+		"                 borrows up to its ceil what the others leave\n"
 		"  --eth-dest=X,MM:MM:MM:MM:MM:MM: Ethernet destination for port X\n"
 		"  --enable-jumbo: Enable jumbo frames\n"
 		"  --max-pkt-len: Under the premise of enabling jumbo,\n"
@@ -315,6 +621,212 @@ parse_max_pkt_len(const char *pktlen)
 	return len;
 }
 
+/* --rate-trace-mode, comma separated */
+static int
+parse_rate_trace_mode(const char *arg, uint32_t *flags)
+{
+	char s[64];
+	char *fld[3];
+	int i, n;
+
+	snprintf(s, sizeof(s), "%s", arg);
+	n = rte_strsplit(s, sizeof(s), fld, RTE_DIM(fld), ',');
+	if (n <= 0)
+		return -1;
+	*flags = 0;
+	for (i = 0; i < n; i++) {
+		if (strcmp(fld[i], "loop") == 0)
+			*flags |= RATE_PROFILE_LOOP;
+		else if (strcmp(fld[i], "interp") == 0)
+			*flags |= RATE_PROFILE_INTERP;
+		else if (strcmp(fld[i], "hold") == 0)
+			*flags |= RATE_PROFILE_HOLD;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/*swap,PCT,DIST or gap,PCT,GAP*/
+static int
+parse_reorder(const char *arg)
+{
+	char s[64];
+	char *fld[3];
+	char *end = NULL;
+	unsigned long n;
+	double pct;
+
+	snprintf(s, sizeof(s), "%s", arg);
+	if (rte_strsplit(s, sizeof(s), fld, RTE_DIM(fld), ',') != 3)
+		return -1;
+	errno = 0;
+	pct = strtod(fld[1], &end);
+	if (errno != 0 || fld[1][0] == '\0' || *end != '\0' || pct < 0 || pct > 100)
+		return -1;
+	errno = 0;
+	n = strtoul(fld[2], &end, 10);
+	if (errno != 0 || fld[2][0] == '\0' || *end != '\0' || n > UINT32_MAX)
+		return -1;
+	if (strcmp(fld[0], "swap") == 0) {
+		if (n == 0)
+			return -1;
+		reorder_mode = REORDER_MODE_SWAP;
+		reorder_distance = n;
+	} else if (strcmp(fld[0], "gap") == 0) {
+		reorder_mode = REORDER_MODE_GAP;
+		reorder_gap = n;
+	} else
+		return -1;
+	reorder_prob = pct / 100;
+	return 0;
+}
+
+static int
+parse_rate_pps(const char *arg)
+{
+	char *end = NULL;
+	unsigned long long pps;
+
+	pps = strtoull(arg, &end, 10);
+	if ((arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+	if (pps == 0)
+		return -1;
+	rate_pps = pps;
+	return 0;
+}
+
+enum class_opt {
+	CLASS_OPT_MAP,		//(value,class)
+	CLASS_OPT_QUANTUM,	//(class,bytes)
+	CLASS_OPT_RATE,		//(class,rate,ceil)
+	CLASS_OPT_PREFIX,	//(a.b.c.d/len,class)
+};
+
+/* a.b.c.d/len of --class-prefix, keeps the list longest prefix first */
+static int
+add_class_prefix(char *arg, unsigned long cls)
+{
+	struct c2s_class_prefix pfx;
+	struct in_addr addr;
+	char *slash, *end;
+	unsigned long len;
+	int i;
+
+	slash = strchr(arg, '/');
+	if (slash == NULL)
+		return -1;
+	*slash = '\0';
+	errno = 0;
+	len = strtoul(slash + 1, &end, 10);
+	if (errno != 0 || end == slash + 1 || *end != '\0' || len > 32)
+		return -1;
+	if (inet_pton(AF_INET, arg, &addr) != 1)
+		return -1;
+	if (c2s_nb_class_prefix >= C2S_MAX_CLASS_PREFIX) {
+		printf("exceeded max number of class prefixes: %d\n",
+			C2S_MAX_CLASS_PREFIX);
+		return -1;
+	}
+	pfx.mask = len == 0 ? 0 : ~0U << (32 - len);
+	pfx.addr = rte_be_to_cpu_32(addr.s_addr) & pfx.mask;
+	pfx.cls = cls;
+	for (i = c2s_nb_class_prefix; i > 0 &&
+			c2s_class_prefix[i - 1].mask < pfx.mask; i--)
+		c2s_class_prefix[i] = c2s_class_prefix[i - 1];
+	c2s_class_prefix[i] = pfx;
+	c2s_nb_class_prefix++;
+	return 0;
+}
+
+/*
+* --class-map, --class-quantum, --class-rate and --class-prefix lists,
+* every class named raises c2s_nb_classes
+*/
+static int
+parse_class_fields(const char *q_arg, int opt)
+{
+	char s[256];
+	const char *p, *p0 = q_arg;
+	char *end;
+	enum fieldnames {
+		FLD_KEY = 0,
+		FLD_VAL,
+		FLD_CEIL,
+		_MAX_FLD
+	};
+	unsigned long int_fld[_MAX_FLD];
+	char *str_fld[_MAX_FLD];
+	unsigned long cls;
+	int i, nb_fld = opt == CLASS_OPT_RATE ? 3 : 2;
+	unsigned size;
+
+	while ((p = strchr(p0,'(')) != NULL) {
+		++p;
+		if((p0 = strchr(p,')')) == NULL)
+			return -1;
+
+		size = p0 - p;
+		if(size >= sizeof(s))
+			return -1;
+
+		snprintf(s, sizeof(s), "%.*s", size, p);
+		if (rte_strsplit(s, sizeof(s), str_fld, nb_fld, ',') != nb_fld)
+			return -1;
+		for (i = opt == CLASS_OPT_PREFIX ? FLD_VAL : FLD_KEY; i < nb_fld; i++){
+			errno = 0;
+			int_fld[i] = strtoul(str_fld[i], &end, 0);
+			if (errno != 0 || end == str_fld[i])
+				return -1;
+		}
+		switch (opt) {
+		case CLASS_OPT_QUANTUM:
+			cls = int_fld[FLD_KEY];
+			if (int_fld[FLD_VAL] == 0 || int_fld[FLD_VAL] > INT32_MAX)
+				return -1;
+			break;
+		case CLASS_OPT_RATE:
+			cls = int_fld[FLD_KEY];
+			if (int_fld[FLD_VAL] > UINT32_MAX || int_fld[FLD_CEIL] > UINT32_MAX ||
+					(int_fld[FLD_CEIL] != 0 && int_fld[FLD_CEIL] < int_fld[FLD_VAL]))
+				return -1;
+			break;
+		case CLASS_OPT_PREFIX:
+			cls = int_fld[FLD_VAL];
+			break;
+		default:
+			cls = int_fld[FLD_VAL];
+			if (int_fld[FLD_KEY] >= RTE_DIM(c2s_class_map))
+				return -1;
+			break;
+		}
+		if (cls == C2S_CLASS_STRICT || cls >= C2S_MAX_CLASSES) {
+			printf("send class must be 1-%d\n", C2S_MAX_CLASSES - 1);
+			return -1;
+		}
+		switch (opt) {
+		case CLASS_OPT_QUANTUM:
+			c2s_class_quantum[cls] = int_fld[FLD_VAL];
+			break;
+		case CLASS_OPT_RATE:
+			c2s_class_rate[cls] = int_fld[FLD_VAL];
+			c2s_class_ceil[cls] = int_fld[FLD_CEIL];
+			break;
+		case CLASS_OPT_PREFIX:
+			if (add_class_prefix(str_fld[FLD_KEY], cls) < 0)
+				return -1;
+			break;
+		default:
+			c2s_class_map[int_fld[FLD_KEY]] = cls;
+			break;
+		}
+		if (cls >= c2s_nb_classes)
+			c2s_nb_classes = cls + 1;
+	}
+	return 0;
+}
+
 static int
 parse_portmask(const char *portmask)
 {
@@ -403,36 +915,61 @@ parse_config(const char *q_arg)
 }
 
 static int
-dist_trans(struct disttable *src,
-			struct disttable *dst,
-			int mu, int sigma)
+parse_lcore_role(const char *q_arg)
 {
-	if(src->size!=dst->size||src==NULL||dst==NULL){
-		return -1;
-	}
-	int i=0;
-	int64_t t,x;
-	for(i=0;i<src->size;i++){
-    	t = src->table[i];
-    	x = (sigma % NETEM_DIST_SCALE) * t;
-
-		if (x >= 0)
-			x += NETEM_DIST_SCALE/2;
-		else
-			x -= NETEM_DIST_SCALE/2;
-    
-		dst->table[i] = x / NETEM_DIST_SCALE + (sigma / NETEM_DIST_SCALE) * t + mu;
-	}
-	if(DELAY_PREC){
-		for(i=0;i<src->size;i++){
-			dst->table[i]=(dst->table[i]/DELAY_PREC)*DELAY_PREC;
-			
-			fprintf(stderr,"%s,src->%d is %lld,dst->%d is %lld\n",__func__,i,src->table[i],i,dst->table[i]);
-			src->table[i]=0;	
+	char s[256];
+	const char *p, *p0 = q_arg;
+	char *end;
+	enum fieldnames {
+		FLD_LCORE = 0,
+		FLD_ROLE,
+		_NUM_FLD
+	};
+	char *str_fld[_NUM_FLD];
+	unsigned long lcore;
+	unsigned size;
+	int role;
+
+	nb_lcore_role_params = 0;
+
+	while ((p = strchr(p0,'(')) != NULL) {
+		++p;
+		if((p0 = strchr(p,')')) == NULL)
+			return -1;
+
+		size = p0 - p;
+		if(size >= sizeof(s))
+			return -1;
+
+		snprintf(s, sizeof(s), "%.*s", size, p);
+		if (rte_strsplit(s, sizeof(s), str_fld, _NUM_FLD, ',') != _NUM_FLD)
+			return -1;
+
+		errno = 0;
+		lcore = strtoul(str_fld[FLD_LCORE], &end, 0);
+		if (errno != 0 || end == str_fld[FLD_LCORE] || lcore >= RTE_MAX_LCORE)
+			return -1;
+
+		for (role = LCORE_ROLE_NONE + 1; role < LCORE_ROLE_MAX; role++)
+			if (strcmp(str_fld[FLD_ROLE], lcore_role_names[role]) == 0)
+				break;
+		if (role == LCORE_ROLE_MAX) {
+			printf("unknown lcore role: %s\n", str_fld[FLD_ROLE]);
+			return -1;
 		}
+
+		if (nb_lcore_role_params >= RTE_MAX_LCORE) {
+			printf("exceeded max number of lcore roles: %hu\n",
+				nb_lcore_role_params);
+			return -1;
+		}
+		lcore_role_params_array[nb_lcore_role_params].lcore_id =
+			(uint8_t)lcore;
+		lcore_role_params_array[nb_lcore_role_params].role =
+			(uint8_t)role;
+		++nb_lcore_role_params;
 	}
-	dst->size=src->size;
-	fprintf(stderr,"%lld\n",dst->table[IPV4_ADDR(192, 168, 112, 0)%dst->size]);
+	lcore_role_params = lcore_role_params_array;
 	return 0;
 }
 
@@ -636,13 +1173,8 @@ parse_dist_table(const char *dist_file,int flag){
 		next=strtok_r(NULL," ",&tmp);
         	}
 		}
-		delay_pool=(struct disttable*)malloc(sizeof(struct disttable)+delay_dist->size*sizeof(int64_t));
-		delay_pool->size=delay_dist->size;
-		dist_trans(delay_dist,delay_pool,DELAY_MEAN,DELAY_JITTER/4);/*
-		if(!dist_trans(delay_dist,delay_pool,DELAY_MEAN,DELAY_JITTER/4)){
-			fprintf(stderr," %s %dfail!!!!\n\n",__func__,__LINE__);
-			exit(-1);
-		}*/
+		/*every pkt draws its delay from here, delay_dist stays for the dist delay profiles*/
+		delay_sampler=dist_sampler_create(delay_dist,DELAY_MEAN,DELAY_JITTER/4);
     	fclose(file);
 		return 0;
 	}
@@ -663,6 +1195,29 @@ static const char short_options[] =
 	;
 
 #define CMD_LINE_OPT_CONFIG "config"
+#define CMD_LINE_OPT_LCORE_ROLE "lcore-role"
+#define CMD_LINE_OPT_RX_SHARED_RING "rx-shared-ring"
+#define CMD_LINE_OPT_OVERLOAD_POLICY "overload-policy"
+#define CMD_LINE_OPT_C2S_SENDER "c2s-sender"
+#define CMD_LINE_OPT_RATE_PPS "rate-pps"
+#define CMD_LINE_OPT_RATE_TRACE "rate-trace"
+#define CMD_LINE_OPT_RATE_TRACE_MODE "rate-trace-mode"
+#define CMD_LINE_OPT_MM_TRACE "mm-trace"
+#define CMD_LINE_OPT_SEED "seed"
+#define CMD_LINE_OPT_DELAY_RULES "delay-rules"
+#define CMD_LINE_OPT_FLOW_TABLE_SIZE "flow-table-size"
+#define CMD_LINE_OPT_DELAY_CORR "delay-corr"
+#define CMD_LINE_OPT_DELAY_ORDER "delay-order"
+#define CMD_LINE_OPT_DELAY_LINE_RATE "delay-line-rate"
+#define CMD_LINE_OPT_DELAY_LINE_MS "delay-line-ms"
+#define CMD_LINE_OPT_DELAY_ARENA_MS "delay-arena-ms"
+#define CMD_LINE_OPT_REORDER "reorder"
+#define CMD_LINE_OPT_REORDER_HOLD_US "reorder-hold-us"
+#define CMD_LINE_OPT_CLASS_BY "class-by"
+#define CMD_LINE_OPT_CLASS_MAP "class-map"
+#define CMD_LINE_OPT_CLASS_QUANTUM "class-quantum"
+#define CMD_LINE_OPT_CLASS_PREFIX "class-prefix"
+#define CMD_LINE_OPT_CLASS_RATE "class-rate"
 #define CMD_LINE_OPT_ETH_DEST "eth-dest"
 #define CMD_LINE_OPT_DIST_TABLE "dist-table"
 #define CMD_LINE_OPT_NO_NUMA "no-numa"
@@ -679,6 +1234,29 @@ enum {
 	 * conflict with short options */
 	CMD_LINE_OPT_MIN_NUM = 256,
 	CMD_LINE_OPT_CONFIG_NUM,
+	CMD_LINE_OPT_LCORE_ROLE_NUM,
+	CMD_LINE_OPT_RX_SHARED_RING_NUM,
+	CMD_LINE_OPT_OVERLOAD_POLICY_NUM,
+	CMD_LINE_OPT_C2S_SENDER_NUM,
+	CMD_LINE_OPT_RATE_PPS_NUM,
+	CMD_LINE_OPT_RATE_TRACE_NUM,
+	CMD_LINE_OPT_RATE_TRACE_MODE_NUM,
+	CMD_LINE_OPT_MM_TRACE_NUM,
+	CMD_LINE_OPT_SEED_NUM,
+	CMD_LINE_OPT_DELAY_RULES_NUM,
+	CMD_LINE_OPT_FLOW_TABLE_SIZE_NUM,
+	CMD_LINE_OPT_DELAY_CORR_NUM,
+	CMD_LINE_OPT_DELAY_ORDER_NUM,
+	CMD_LINE_OPT_DELAY_LINE_RATE_NUM,
+	CMD_LINE_OPT_DELAY_LINE_MS_NUM,
+	CMD_LINE_OPT_DELAY_ARENA_MS_NUM,
+	CMD_LINE_OPT_REORDER_NUM,
+	CMD_LINE_OPT_REORDER_HOLD_US_NUM,
+	CMD_LINE_OPT_CLASS_BY_NUM,
+	CMD_LINE_OPT_CLASS_MAP_NUM,
+	CMD_LINE_OPT_CLASS_QUANTUM_NUM,
+	CMD_LINE_OPT_CLASS_PREFIX_NUM,
+	CMD_LINE_OPT_CLASS_RATE_NUM,
 	CMD_LINE_OPT_DIST_TABLE_NUM,
 	CMD_LINE_OPT_NO_NUMA_NUM,
 	CMD_LINE_OPT_IPV6_NUM,
@@ -690,6 +1268,29 @@ enum {
 
 static const struct option lgopts[] = {
 	{CMD_LINE_OPT_CONFIG, 1, 0, CMD_LINE_OPT_CONFIG_NUM},
+	{CMD_LINE_OPT_LCORE_ROLE, 1, 0, CMD_LINE_OPT_LCORE_ROLE_NUM},
+	{CMD_LINE_OPT_RX_SHARED_RING, 0, 0, CMD_LINE_OPT_RX_SHARED_RING_NUM},
+	{CMD_LINE_OPT_OVERLOAD_POLICY, 1, 0, CMD_LINE_OPT_OVERLOAD_POLICY_NUM},
+	{CMD_LINE_OPT_C2S_SENDER, 1, 0, CMD_LINE_OPT_C2S_SENDER_NUM},
+	{CMD_LINE_OPT_RATE_PPS, 1, 0, CMD_LINE_OPT_RATE_PPS_NUM},
+	{CMD_LINE_OPT_RATE_TRACE, 1, 0, CMD_LINE_OPT_RATE_TRACE_NUM},
+	{CMD_LINE_OPT_RATE_TRACE_MODE, 1, 0, CMD_LINE_OPT_RATE_TRACE_MODE_NUM},
+	{CMD_LINE_OPT_MM_TRACE, 1, 0, CMD_LINE_OPT_MM_TRACE_NUM},
+	{CMD_LINE_OPT_SEED, 1, 0, CMD_LINE_OPT_SEED_NUM},
+	{CMD_LINE_OPT_DELAY_RULES, 1, 0, CMD_LINE_OPT_DELAY_RULES_NUM},
+	{CMD_LINE_OPT_FLOW_TABLE_SIZE, 1, 0, CMD_LINE_OPT_FLOW_TABLE_SIZE_NUM},
+	{CMD_LINE_OPT_DELAY_CORR, 1, 0, CMD_LINE_OPT_DELAY_CORR_NUM},
+	{CMD_LINE_OPT_DELAY_ORDER, 1, 0, CMD_LINE_OPT_DELAY_ORDER_NUM},
+	{CMD_LINE_OPT_DELAY_LINE_RATE, 1, 0, CMD_LINE_OPT_DELAY_LINE_RATE_NUM},
+	{CMD_LINE_OPT_DELAY_LINE_MS, 1, 0, CMD_LINE_OPT_DELAY_LINE_MS_NUM},
+	{CMD_LINE_OPT_DELAY_ARENA_MS, 1, 0, CMD_LINE_OPT_DELAY_ARENA_MS_NUM},
+	{CMD_LINE_OPT_REORDER, 1, 0, CMD_LINE_OPT_REORDER_NUM},
+	{CMD_LINE_OPT_REORDER_HOLD_US, 1, 0, CMD_LINE_OPT_REORDER_HOLD_US_NUM},
+	{CMD_LINE_OPT_CLASS_BY, 1, 0, CMD_LINE_OPT_CLASS_BY_NUM},
+	{CMD_LINE_OPT_CLASS_MAP, 1, 0, CMD_LINE_OPT_CLASS_MAP_NUM},
+	{CMD_LINE_OPT_CLASS_QUANTUM, 1, 0, CMD_LINE_OPT_CLASS_QUANTUM_NUM},
+	{CMD_LINE_OPT_CLASS_PREFIX, 1, 0, CMD_LINE_OPT_CLASS_PREFIX_NUM},
+	{CMD_LINE_OPT_CLASS_RATE, 1, 0, CMD_LINE_OPT_CLASS_RATE_NUM},
 	{CMD_LINE_OPT_DIST_TABLE, 1, 0, CMD_LINE_OPT_DIST_TABLE_NUM},
 	{CMD_LINE_OPT_NO_NUMA, 0, 0, CMD_LINE_OPT_NO_NUMA_NUM},
 	{CMD_LINE_OPT_IPV6, 0, 0, CMD_LINE_OPT_IPV6_NUM},
@@ -722,6 +1323,8 @@ parse_args(int argc, char **argv)
 	char **argvopt;
 	int option_index;
 	char *prgname = argv[0];
+	const char *rate_trace = NULL;
+	uint32_t rate_trace_flags = 0;
 
 	argvopt = argv;
 
@@ -758,6 +1361,234 @@ parse_args(int argc, char **argv)
 			}
 			break;
 
+		case CMD_LINE_OPT_LCORE_ROLE_NUM:
+			ret = parse_lcore_role(optarg);
+			if (ret) {
+				fprintf(stderr, "Invalid lcore role\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_RX_SHARED_RING_NUM:
+			rx_shared_ring = TRUE;
+			break;
+
+		case CMD_LINE_OPT_OVERLOAD_POLICY_NUM:
+			if (strcmp(optarg, "taildrop") == 0)
+				overload_policy = OVERLOAD_TAILDROP;
+			else if (strcmp(optarg, "keep-highpri") == 0)
+				overload_policy = OVERLOAD_KEEP_HIGHPRI;
+			else {
+				fprintf(stderr, "Invalid overload policy\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_RATE_PPS_NUM:
+			if (parse_rate_pps(optarg) < 0) {
+				fprintf(stderr, "Invalid rate pps\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_RATE_TRACE_NUM:
+			rate_trace = optarg;
+			break;
+
+		case CMD_LINE_OPT_SEED_NUM:
+		{
+			char *end = NULL;
+
+			errno = 0;
+			lrand_seed = strtoull(optarg, &end, 0);
+			if (errno != 0 || optarg[0] == '\0' || *end != '\0') {
+				fprintf(stderr, "Invalid seed\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+		}
+
+		case CMD_LINE_OPT_DELAY_RULES_NUM:
+			delay_rules_file = optarg;
+			break;
+
+		case CMD_LINE_OPT_FLOW_TABLE_SIZE_NUM:
+		{
+			char *end = NULL;
+			unsigned long n;
+
+			errno = 0;
+			n = strtoul(optarg, &end, 0);
+			if (errno != 0 || optarg[0] == '\0' || *end != '\0' ||
+					n == 0 || n > UINT32_MAX) {
+				fprintf(stderr, "Invalid flow table size\n");
+				print_usage(prgname);
+				return -1;
+			}
+			flow_table_size = n;
+			break;
+		}
+
+		case CMD_LINE_OPT_DELAY_CORR_NUM:
+		{
+			char *end = NULL;
+			unsigned long n;
+
+			errno = 0;
+			n = strtoul(optarg, &end, 10);
+			if (errno != 0 || optarg[0] == '\0' || *end != '\0' || n > 100) {
+				fprintf(stderr, "Invalid delay correlation\n");
+				print_usage(prgname);
+				return -1;
+			}
+			delay_corr = n;
+			break;
+		}
+
+		case CMD_LINE_OPT_DELAY_ORDER_NUM:
+			if (strcmp(optarg, "reorder") == 0)
+				delay_keep_order = FALSE;
+			else if (strcmp(optarg, "keep") == 0)
+				delay_keep_order = TRUE;
+			else {
+				fprintf(stderr, "Invalid delay order\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_DELAY_LINE_RATE_NUM:
+		case CMD_LINE_OPT_DELAY_LINE_MS_NUM:
+		case CMD_LINE_OPT_DELAY_ARENA_MS_NUM:
+		{
+			char *end = NULL;
+			unsigned long n;
+
+			errno = 0;
+			n = strtoul(optarg, &end, 10);
+			if (errno != 0 || optarg[0] == '\0' || *end != '\0' ||
+					n == 0 || n > UINT32_MAX) {
+				fprintf(stderr, "Invalid delay %s\n",
+					opt == CMD_LINE_OPT_DELAY_LINE_RATE_NUM ? "line rate" :
+					opt == CMD_LINE_OPT_DELAY_LINE_MS_NUM ? "line length" : "arena time");
+				print_usage(prgname);
+				return -1;
+			}
+			if (opt == CMD_LINE_OPT_DELAY_LINE_RATE_NUM)
+				delay_line_rate_mbps = n;
+			else if (opt == CMD_LINE_OPT_DELAY_LINE_MS_NUM)
+				delay_line_ms = n;
+			else
+				delay_arena_ms = n;
+			break;
+		}
+
+		case CMD_LINE_OPT_REORDER_NUM:
+			if (parse_reorder(optarg) < 0) {
+				fprintf(stderr, "Invalid reorder\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_REORDER_HOLD_US_NUM:
+		{
+			char *end = NULL;
+			unsigned long n;
+
+			errno = 0;
+			n = strtoul(optarg, &end, 10);
+			if (errno != 0 || optarg[0] == '\0' || *end != '\0' ||
+					n == 0 || n > UINT32_MAX) {
+				fprintf(stderr, "Invalid reorder hold time\n");
+				print_usage(prgname);
+				return -1;
+			}
+			reorder_hold_us = n;
+			break;
+		}
+
+		case CMD_LINE_OPT_C2S_SENDER_NUM:
+			if (strcmp(optarg, "timer") == 0)
+				c2s_sender = C2S_SENDER_TIMER;
+			else if (strcmp(optarg, "train") == 0)
+				c2s_sender = C2S_SENDER_TRAIN;
+			else if (strcmp(optarg, "rate") == 0)
+				c2s_sender = C2S_SENDER_RATE;
+			else {
+				fprintf(stderr, "Invalid c2s sender\n");
+				print_usage(prgname);
+				return -1;
+			}
+			c2s_sender_given = 1;
+			break;
+
+		case CMD_LINE_OPT_MM_TRACE_NUM:
+			mm_trace = mm_trace_load(optarg);
+			break;
+
+		case CMD_LINE_OPT_RATE_TRACE_MODE_NUM:
+			if (parse_rate_trace_mode(optarg, &rate_trace_flags) < 0) {
+				fprintf(stderr, "Invalid rate trace mode\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_CLASS_BY_NUM:
+			if (strcmp(optarg, "marker") == 0)
+				c2s_class_by = CLASS_BY_MARKER;
+			else if (strcmp(optarg, "dscp") == 0)
+				c2s_class_by = CLASS_BY_DSCP;
+			else if (strcmp(optarg, "pcp") == 0)
+				c2s_class_by = CLASS_BY_PCP;
+			else if (strcmp(optarg, "vlan") == 0)
+				c2s_class_by = CLASS_BY_VLAN;
+			else if (strcmp(optarg, "dst") == 0)
+				c2s_class_by = CLASS_BY_DST;
+			else {
+				fprintf(stderr, "Invalid class field\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_CLASS_MAP_NUM:
+			if (parse_class_fields(optarg, CLASS_OPT_MAP) < 0) {
+				fprintf(stderr, "Invalid class map\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_CLASS_QUANTUM_NUM:
+			if (parse_class_fields(optarg, CLASS_OPT_QUANTUM) < 0) {
+				fprintf(stderr, "Invalid class quantum\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_CLASS_RATE_NUM:
+			if (parse_class_fields(optarg, CLASS_OPT_RATE) < 0) {
+				fprintf(stderr, "Invalid class rate\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_CLASS_PREFIX_NUM:
+			if (parse_class_fields(optarg, CLASS_OPT_PREFIX) < 0) {
+				fprintf(stderr, "Invalid class prefix\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
 		case CMD_LINE_OPT_DIST_TABLE_NUM:
 			ret=parse_dist_table(optarg,DIST_FLAG);
 			if(ret){
@@ -828,7 +1659,8 @@ parse_args(int argc, char **argv)
 	}
 
 	l2shaping_lpm_on = 1;
-	
+	if (rate_trace != NULL)
+		rate_profile = rate_profile_load(rate_trace, rate_trace_flags);
 
 	if (optind >= 0)
 		argv[optind-1] = prgname;
@@ -874,7 +1706,7 @@ init_mem(uint16_t portid, unsigned int nb_mbuf)
 				 portid, socketid);
 			pktmbuf_pool[portid][socketid] =
 				rte_pktmbuf_pool_create(s, nb_mbuf,
-					MEMPOOL_CACHE_SIZE, 0,
+					MEMPOOL_CACHE_SIZE, PKT_META_PRIV_SIZE,
 					RTE_MBUF_DEFAULT_BUF_SIZE, socketid);
 			if (pktmbuf_pool[portid][socketid] == NULL)
 				rte_exit(EXIT_FAILURE,
@@ -901,6 +1733,24 @@ init_mem(uint16_t portid, unsigned int nb_mbuf)
 	return 0;
 }
 
+/* Speed of the c2s tx port, the rate control fills by it */
+static uint32_t
+get_link_speed(uint16_t portid)
+{
+	struct rte_eth_link link;
+
+	memset(&link, 0, sizeof(link));
+	if (rte_eth_link_get_nowait(portid, &link) < 0 ||
+			link.link_status == ETH_LINK_DOWN ||
+			link.link_speed == ETH_SPEED_NUM_NONE) {
+		printf("Port %u link speed unknown, rate control assumes %u Mbps\n",
+			portid, DEFAULT_LINK_SPEED_MBPS);
+		return DEFAULT_LINK_SPEED_MBPS;
+	}
+	printf("Port %u rate control at %u Mbps\n", portid, link.link_speed);
+	return link.link_speed;
+}
+
 /* Check the link status of all ports in up to 9s, and print them finally */
 static void
 check_all_ports_link_status(uint32_t port_mask)
@@ -1023,24 +1873,11 @@ void ShowStack(void)
 	free(symbols);
 }
 
+/*spin on the tsc, nanosleep can not sleep less than tens of us*/
 int nano_delay(long delay)
 {
-    struct timespec req, rem;
-    long nano_delay = delay;
-    int ret = 0;
-    while(nano_delay > 0)
-    {
-            rem.tv_sec = 0;
-            rem.tv_nsec = 0;
-            req.tv_sec = 0;
-            req.tv_nsec = nano_delay;
-            if(ret = (nanosleep(&req, &rem) == -1))
-            {
-                printf("nanosleep failed.\n");                
-            }
-            nano_delay = rem.tv_nsec;
-    }
-    return ret;
+    time_wait_until(time_now()+ns_to_tsc(delay));
+    return 0;
 }
 
 static uint16_t
@@ -1071,6 +1908,9 @@ main(int argc, char **argv)
 	unsigned lcore_id;
 	uint32_t n_tx_queue, nb_lcores;
 	uint8_t nb_rx_queue, queue, socketid;
+	unsigned i, nb_classifiers;
+	unsigned int nb_mbuf;
+	char s[64];
 
 	/* init EAL */
 	ret = rte_eal_init(argc, argv);
@@ -1079,6 +1919,9 @@ main(int argc, char **argv)
 	argc -= ret;
 	argv += ret;
 
+	/* all stages take their time from the tsc */
+	time_init();
+
 	force_quit = false;
 
 	signal(SIGINT, signal_handler);
@@ -1086,10 +1929,37 @@ main(int argc, char **argv)
 	
 	//signal(SIGSEGV, sigsegv_handler);
 
+	/* send classes before the options change them: one DRR class gets all */
+	c2s_nb_classes = C2S_CLASS_DEFAULT + 1;
+	memset(c2s_class_map, C2S_CLASS_DEFAULT, sizeof(c2s_class_map));
+	for (i = 0; i < C2S_MAX_CLASSES; i++)
+		c2s_class_quantum[i] = C2S_CLASS_QUANTUM;
+
+	lrand_seed = rte_rdtsc() ^ time(NULL);
+	c2s_sender = GAP_DIST_MODE == 0 ? C2S_SENDER_RATE : C2S_SENDER_TIMER;
+	delay_corr = DELAY_CORR;
+	delay_keep_order = DELAY_KEEP_ORDER;
+	flow_table_size = FLOW_TABLE_SIZE;
+	delay_line_rate_mbps = DELAY_LINE_RATE_MBPS;
+	reorder_mode = REORDER_SWAP_MODE ? REORDER_MODE_SWAP : REORDER_MODE_GAP;
+	reorder_prob = REORDER_PROB;
+	reorder_distance = REORDER_DISTANCE;
+	reorder_gap = REORDER_GAP;
+	reorder_hold_us = REORDER_HOLD_US;
+
 	/* parse application arguments (after the EAL ones) */
 	ret = parse_args(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid l2shaping parameters\n");
+	printf("random seed %" PRIu64 "\n", lrand_seed);
+	/* mu and sigma go into the sampler tables once, uniform without a dist table */
+	gap_sampler = dist_sampler_create(gap_pool, GAP_MEAN, GAP_JITTER/4);
+	if (delay_sampler == NULL)
+		delay_sampler = dist_sampler_create(NULL, DELAY_MEAN, DELAY_JITTER/4);
+	/* the default profile is the delay sampler */
+	delay_profile_default();
+	if (delay_rules_file != NULL)
+		delay_rules_load(delay_rules_file);
 
 	if (check_lcore_params() < 0)
 		rte_exit(EXIT_FAILURE, "check_lcore_params failed\n");
@@ -1098,6 +1968,19 @@ main(int argc, char **argv)
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "init_lcore_rx_queues failed\n");
 
+	if (init_lcore_roles() < 0)
+		rte_exit(EXIT_FAILURE, "init_lcore_roles failed\n");
+	/* the pool also holds what the delay line may keep */
+	nb_mbuf = 524288;
+	if (DELAY_MODE_OPEN) {
+		uint64_t nb_delay = delay_line_init(nb_role_instances[LCORE_ROLE_DELAY]);
+
+		if (nb_delay > UINT32_MAX - nb_mbuf)
+			rte_exit(EXIT_FAILURE, "Delay line of %" PRIu64 " mbufs is too long\n",
+				nb_delay);
+		nb_mbuf += nb_delay;
+	}
+
 	nb_ports = rte_eth_dev_count_avail();
 
 	if (check_port_config() < 0)
@@ -1109,17 +1992,56 @@ main(int argc, char **argv)
 	setup_l2shaping_lookup_tables();
 
 	/*edit */
-	produce_packs_pool=rte_pktmbuf_pool_create("produce_packs_pool", 2097152, 0, 0,RTE_MBUF_DEFAULT_BUF_SIZE, SOCKET_ID_ANY);
+	produce_packs_pool=rte_pktmbuf_pool_create("produce_packs_pool", PRODUCE_PACKS_POOL_SIZE, 0, 0,RTE_MBUF_DEFAULT_BUF_SIZE, SOCKET_ID_ANY);
 	init_void_packets();
-	c2s_send_queue = rte_ring_create("Buffer_Ring0", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_send_queue_highpri= rte_ring_create("Buffer_Ring01", RING_SIZE, SOCKET_ID_ANY,0);
-	s2c_send_queue = rte_ring_create("Buffer_Ring1", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_receive_queue= rte_ring_create("Buffer_Ring2", RING_SIZE, SOCKET_ID_ANY,0);
-	s2c_receive_queue= rte_ring_create("Buffer_Ring3", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_drop_process_queue= rte_ring_create("Buffer_Ring4", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_delay_process_queue= rte_ring_create("Buffer_Ring5", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_dump_process_queue= rte_ring_create("Buffer_Ring6", RING_SIZE, SOCKET_ID_ANY,0);
-	c2s_reorder_process_queue= rte_ring_create("Buffer_Ring7", RING_SIZE, SOCKET_ID_ANY,0);
+	/*
+	* rings get SP/SC flags from the lcores that really use them,
+	* c2s classifiers are the c2s_filter and c2s_rtc lcores
+	*/
+	nb_classifiers = nb_role_instances[LCORE_ROLE_C2S_FILTER] +
+		nb_role_instances[LCORE_ROLE_C2S_RTC];
+	c2s_send_queue = stage_ring_create("Buffer_Ring0", RING_SIZE,
+		nb_role_instances[LCORE_ROLE_C2S_FILTER] +
+		nb_role_instances[LCORE_ROLE_DELAY] +
+		nb_role_instances[LCORE_ROLE_REORDER] +
+		nb_role_instances[LCORE_ROLE_DUMP], 1);
+	/*no stage feeds the strict class now, the ring stays for class_sched*/
+	c2s_send_queue_highpri= stage_ring_create("Buffer_Ring01", RING_SIZE, 0, 1);
+	c2s_class_queue[C2S_CLASS_STRICT] = c2s_send_queue_highpri;
+	c2s_class_queue[C2S_CLASS_DEFAULT] = c2s_send_queue;
+	for (i = C2S_CLASS_DEFAULT + 1; i < c2s_nb_classes; i++) {
+		snprintf(s, sizeof(s), "Buffer_Ring0_%u", i);
+		c2s_class_queue[i] = stage_ring_create(s, RING_SIZE,
+			nb_role_instances[LCORE_ROLE_C2S_FILTER] +
+			nb_role_instances[LCORE_ROLE_DELAY] +
+			nb_role_instances[LCORE_ROLE_REORDER] +
+			nb_role_instances[LCORE_ROLE_DUMP], 1);
+	}
+	s2c_send_queue = stage_ring_create("Buffer_Ring1", RING_SIZE, 1, 1);
+	c2s_receive_queue= stage_ring_create("Buffer_Ring2", RING_SIZE,
+		nb_role_instances[LCORE_ROLE_C2S_RX],
+		nb_role_instances[LCORE_ROLE_C2S_FILTER]);
+	for (i = 0; !rx_shared_ring && i < nb_role_instances[LCORE_ROLE_C2S_RX]; i++) {
+		snprintf(s, sizeof(s), "Buffer_Ring2_%u", i);
+		c2s_receive_shard_queue[i]= stage_ring_create(s, RING_SIZE, 1, 1);
+	}
+	s2c_receive_queue= stage_ring_create("Buffer_Ring3", RING_SIZE,
+		nb_role_instances[LCORE_ROLE_S2C_RX], 1);
+	c2s_drop_process_queue= stage_ring_create("Buffer_Ring4", RING_SIZE,
+		nb_classifiers, 1);
+	for (i = 0; i < RTE_MAX(nb_role_instances[LCORE_ROLE_DELAY], 1); i++) {
+		snprintf(s, sizeof(s), "Buffer_Ring5_%u", i);
+		c2s_delay_process_queue[i]= stage_ring_create(s, RING_SIZE,
+			nb_classifiers, 1);
+	}
+	c2s_dump_process_queue= stage_ring_create("Buffer_Ring6", RING_SIZE, 1, 1);
+	for (i = 0; i < RTE_MAX(nb_role_instances[LCORE_ROLE_REORDER], 1); i++) {
+		snprintf(s, sizeof(s), "Buffer_Ring7_%u", i);
+		c2s_reorder_process_queue[i]= stage_ring_create(s, RING_SIZE,
+			nb_classifiers, 1);
+	}
+	if (nb_role_instances[LCORE_ROLE_GAP_GEN] != 0)
+		gap_sched_ring = gap_sched_ring_create();
 	c2s_reframe_queue= rte_ring_create("Buffer_Ring  8", RING_SIZE, SOCKET_ID_ANY,0);
 	c2s_reframe_queue0= rte_ring_create("Buffer_Ring  80", RING_SIZE, SOCKET_ID_ANY,0);
 	c2s_reframe_queue1= rte_ring_create("Buffer_Ring  81", RING_SIZE, SOCKET_ID_ANY,0);
@@ -1148,6 +2070,13 @@ main(int argc, char **argv)
 			n_tx_queue = MAX_TX_QUEUE_PER_PORT;
 		printf("Creating queues: nb_rxq=%d nb_txq=%u... ",
 			nb_rx_queue, (unsigned)n_tx_queue );
+		/*every c2s_filter lcore sends its small pkts on a tx queue of its own*/
+		if (portid == PORT_TO_SERVER &&
+				QUEUE_TO_SERVER_WITHOUT_PAYLOAD + nb_role_instances[LCORE_ROLE_C2S_FILTER] > n_tx_queue)
+			rte_exit(EXIT_FAILURE,
+				"port %d has %u tx queues, %u c2s_filter lcores need %u\n",
+				portid, (unsigned)n_tx_queue, nb_role_instances[LCORE_ROLE_C2S_FILTER],
+				QUEUE_TO_SERVER_WITHOUT_PAYLOAD + nb_role_instances[LCORE_ROLE_C2S_FILTER]);
 
 		ret = rte_eth_dev_info_get(portid, &dev_info);
 		if (ret != 0)
@@ -1155,9 +2084,10 @@ main(int argc, char **argv)
 				"Error during getting device (port %u) info: %s\n",
 				portid, strerror(-ret));
 
-		if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
-			local_port_conf.txmode.offloads |=
-				DEV_TX_OFFLOAD_MBUF_FAST_FREE;
+		/*
+		 * no DEV_TX_OFFLOAD_MBUF_FAST_FREE: the filler templates are sent
+		 * with refcnt > 1 and tx mixes mbufs of several pools
+		 */
 
 		local_port_conf.rx_adv_conf.rss_conf.rss_hf &=
 			dev_info.flow_type_rss_offloads;
@@ -1199,10 +2129,10 @@ main(int argc, char **argv)
 			 * rather, it signifies that portid is ignored.
 			 */
 			//ret = init_mem(0, NB_MBUF(nb_ports));
-			ret = init_mem(0, 524288);
+			ret = init_mem(0, nb_mbuf);
 		} else {
 			//ret = init_mem(portid, NB_MBUF(1));
-			ret = init_mem(0, 524288);
+			ret = init_mem(0, nb_mbuf);
 		}
 		if (ret < 0)
 			rte_exit(EXIT_FAILURE, "init_mem failed\n");
@@ -1333,13 +2263,11 @@ main(int argc, char **argv)
 
 
 	check_all_ports_link_status(enabled_port_mask);
+	link_speed_mbps = get_link_speed(PORT_TO_SERVER);
 
 	/*edit*/
 	//rte_eth_add_tx_callback(PORT_TO_CLIENT, QUEUE_TO_CLIENT_WITH_PAYLOAD, rate_control_to_client, NULL);
 	//rte_eth_add_tx_callback(PORT_TO_SERVER, QUEUE_TO_SERVER_WITHOUT_PAYLOAD, rate_control_to_server, NULL);
-	void_pack_pool=rte_pktmbuf_pool_create("void_pack_pool", 128, 0, 0,RTE_MBUF_DEFAULT_BUF_SIZE, SOCKET_ID_ANY);
-	//make_void_packs();
-	//make_a_void_pack();
 	/*edit over */
 
 	ret = 0;
@@ -1365,12 +2293,15 @@ main(int argc, char **argv)
 	return ret;
 }
 
+/*one filler template per size, the senders only take references on them*/
 void init_void_packets(){
-    int i,j;
-
-    for(i=0;i<MAX_VOID_PKT_LEN;i++){
-		for(j=0;j<MAX_VOID_BURST_SIZE;j++){
-        	void_packs[i][j]=NULL;
-    	}
-	}
+    int i;
+
+	void_pack_pool=rte_pktmbuf_pool_create("void_pack_pool", VOID_PACK_POOL_SIZE, 0, 0,RTE_MBUF_DEFAULT_BUF_SIZE, SOCKET_ID_ANY);
+	if (void_pack_pool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot init void pack pool\n");
+    for(i=0;i<=MAX_VOID_PKT_LEN;i++)
+		void_pkt_tmpl[i]=NULL;
+    for(i=MIN_VOID_PKT_LEN;i<=MAX_VOID_PKT_LEN;i++)
+		make_void_packs(i);
 }